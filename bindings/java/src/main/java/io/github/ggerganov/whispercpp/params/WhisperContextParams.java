@@ -40,6 +40,12 @@ public class WhisperContextParams extends Structure {
     /** DTW memory size (internal use) */
     public NativeLong dtw_mem_size;
 
+    /** Map the model file instead of reading it (default = true) */
+    public CBool use_mmap;
+
+    /** Lock the mapped model file in memory (default = false) */
+    public CBool use_mlock;
+
     /** Use GPU for inference */
     public void useGpu(boolean enable) {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
@@ -70,7 +76,9 @@ public class WhisperContextParams extends Structure {
             "dtw_aheads_preset",
             "dtw_n_top",
             "dtw_aheads",
-            "dtw_mem_size"
+            "dtw_mem_size",
+            "use_mmap",
+            "use_mlock"
         );
     }
 
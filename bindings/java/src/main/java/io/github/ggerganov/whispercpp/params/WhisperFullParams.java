@@ -143,6 +143,25 @@ public class WhisperFullParams extends Structure {
     /** Overwrite the audio context size (0 = use default). */
     public int audio_ctx;
 
+    /** [EXPERIMENTAL] Compute the mel spectrogram one window at a time (default = false) */
+    public CBool mel_window;
+
+    /** Compute the mel spectrogram one window at a time */
+    public void melWindow(boolean enable) {
+        mel_window = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** [EXPERIMENTAL] Greedy decoding at t == 0: reduce the logits on the device (default = false) */
+    public CBool greedy_on_device;
+
+    /** Reduce the logits on the device, only the argmax and the statistics are copied back */
+    public void greedyOnDevice(boolean enable) {
+        greedy_on_device = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** [EXPERIMENTAL] Encode up to encode_batch fixed-stride windows at once (0 = off) */
+    public int encode_batch;
+
     /** Enable tinydiarize (default = false) */
     public CBool tdrz_enable;
 
@@ -222,6 +241,12 @@ public class WhisperFullParams extends Structure {
     /** No speech threshold. */
     public float no_speech_thold;
 
+    /** [EXPERIMENTAL] Tokens repeated for early loop detection (0 = disabled). */
+    public int rep_n_tokens;
+
+    /** [EXPERIMENTAL] Max n-gram size for early loop detection. */
+    public int rep_ngram_max;
+
     /** Greedy decoding parameters. */
     public GreedyParams greedy;
 
@@ -336,12 +361,14 @@ public class WhisperFullParams extends Structure {
                 "no_timestamps", "single_segment", "print_special",
                 "print_progress", "print_realtime", "print_timestamps",
                 "token_timestamps", "thold_pt", "thold_ptsum", "max_len",
-                "split_on_word", "max_tokens", "debug_mode", "audio_ctx", 
+                "split_on_word", "max_tokens", "debug_mode", "audio_ctx", "mel_window", "greedy_on_device",
+                "encode_batch",
                 "tdrz_enable", "suppress_regex", "initial_prompt",
                 "prompt_tokens", "prompt_n_tokens", "language", "detect_language",
                 "suppress_blank", "suppress_nst", "temperature",
                 "max_initial_ts", "length_penalty", "temperature_inc",
-                "entropy_thold", "logprob_thold", "no_speech_thold", "greedy",
+                "entropy_thold", "logprob_thold", "no_speech_thold",
+                "rep_n_tokens", "rep_ngram_max", "greedy",
                 "beam_search", "new_segment_callback", "new_segment_callback_user_data",
                 "progress_callback", "progress_callback_user_data",
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
@@ -1,14 +1,22 @@
 #include "whisper.h"
 
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <random>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - logits processing
 
     std::string model = "models/ggml-base.en.bin";
 
@@ -53,6 +61,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - logits processing (log_softmax, probs)\n",  "");
     fprintf(stderr, "  -ng,      --no-gpu      [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn  [%-7s] enable flash attention\n",                      params.flash_attn ? "true" : "false");
     fprintf(stderr, "\n");
@@ -155,6 +164,163 @@ static int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// compare the soft_max kernel of the CPU backend, used for the logits processing, with the scalar loops
+static int whisper_bench_logits() {
+    fprintf(stderr, "system_info: %s\n", whisper_print_system_info());
+
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+
+    auto * soft_max_fn = reg ? (ggml_backend_cpu_vec_soft_max_f32_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_vec_soft_max_f32") : nullptr;
+    if (soft_max_fn == nullptr) {
+        fprintf(stderr, "error: the CPU backend does not provide ggml_backend_cpu_vec_soft_max_f32\n");
+        return 2;
+    }
+
+    const int n_iter  = 1000;
+    const int n_vocab = 51865;
+    const int n_ts    = 1501;
+    const int tok_beg = n_vocab - n_ts;
+
+    std::vector<float> logits(n_vocab);
+    std::vector<float> logprobs(n_vocab);
+    std::vector<float> probs(n_vocab);
+    std::vector<float> logprobs_ref(n_vocab);
+    std::vector<float> probs_ref(n_vocab);
+
+    {
+        std::mt19937 rng(0);
+        std::normal_distribution<float> dist(0.0f, 4.0f);
+
+        for (int i = 0; i < n_vocab; ++i) {
+            logits[i] = dist(rng);
+        }
+
+        // emulate the suppressed tokens
+        for (int i = 0; i < n_vocab; i += 13) {
+            logits[i] = -INFINITY;
+        }
+    }
+
+    const auto logsumexp_scalar = [&](const float * x, int n) {
+        const float max = *std::max_element(x, x + n);
+        float sum = 0.0f;
+        for (int i = 0; i < n; ++i) {
+            if (x[i] > -INFINITY) {
+                sum += expf(x[i] - max);
+            }
+        }
+        return logf(sum) + max;
+    };
+
+    const auto logsumexp_vec = [&](const float * x, int n, float * tmp) {
+        const float max = *std::max_element(x, x + n);
+        return logf(soft_max_fn(n, tmp, x, max)) + max;
+    };
+
+    const auto logprobs_scalar = [&](const float * x, float * y) {
+        const float lse = logsumexp_scalar(x, n_vocab);
+        for (int i = 0; i < n_vocab; ++i) {
+            y[i] = x[i] > -INFINITY ? x[i] - lse : -INFINITY;
+        }
+    };
+
+    const auto logprobs_vec = [&](const float * x, float * y) {
+        const float lse = logsumexp_vec(x, n_vocab, y);
+        for (int i = 0; i < n_vocab; ++i) {
+            y[i] = x[i] - lse;
+        }
+    };
+
+    const auto probs_scalar = [&](const float * lp, float * y) {
+        for (int i = 0; i < n_vocab; ++i) {
+            y[i] = lp[i] == -INFINITY ? 0.0f : expf(lp[i]);
+        }
+    };
+
+    const auto probs_vec = [&](const float * lp, float * y) {
+        soft_max_fn(n_vocab, y, lp, 0.0f);
+    };
+
+    double sum = 0.0;
+
+    const auto bench = [&](const char * name, const std::function<void()> & f_ref, const std::function<void()> & f_vec, double diff) {
+        double t_ref = 0.0;
+        double t_vec = 0.0;
+
+        // heat-up
+        f_ref();
+        f_vec();
+
+        for (int i = 0; i < n_iter; ++i) {
+            const int64_t t0 = ggml_time_us();
+            f_ref();
+            const int64_t t1 = ggml_time_us();
+            f_vec();
+            const int64_t t2 = ggml_time_us();
+
+            t_ref += t1 - t0;
+            t_vec += t2 - t1;
+        }
+
+        t_ref /= n_iter;
+        t_vec /= n_iter;
+
+        fprintf(stderr, "%-12s: scalar %8.2f us, ggml %8.2f us, speed-up %5.2fx, max diff %.3e\n",
+                name, t_ref, t_vec, t_vec > 0.0 ? t_ref/t_vec : 0.0, diff);
+    };
+
+    fprintf(stderr, "logits: n_vocab = %d, n_iter = %d\n", n_vocab, n_iter);
+
+    {
+        logprobs_scalar(logits.data(), logprobs_ref.data());
+        logprobs_vec   (logits.data(), logprobs.data());
+
+        double diff = 0.0;
+        for (int i = 0; i < n_vocab; ++i) {
+            if (logits[i] > -INFINITY) {
+                diff = std::max(diff, (double) std::fabs(logprobs[i] - logprobs_ref[i]));
+            } else if (logprobs[i] != -INFINITY) {
+                diff = INFINITY;
+            }
+        }
+
+        bench("log_softmax",
+            [&]() { logprobs_scalar(logits.data(), logprobs_ref.data()); sum += logprobs_ref[n_vocab - 1]; },
+            [&]() { logprobs_vec   (logits.data(), logprobs.data());     sum += logprobs[n_vocab - 1]; },
+            diff);
+    }
+
+    {
+        probs_scalar(logprobs_ref.data(), probs_ref.data());
+        probs_vec   (logprobs.data(),     probs.data());
+
+        double diff = 0.0;
+        for (int i = 0; i < n_vocab; ++i) {
+            diff = std::max(diff, (double) std::fabs(probs[i] - probs_ref[i]));
+        }
+
+        bench("probs",
+            [&]() { probs_scalar(logprobs_ref.data(), probs_ref.data()); sum += probs_ref[n_vocab - 1]; },
+            [&]() { probs_vec   (logprobs.data(),     probs.data());     sum += probs[n_vocab - 1]; },
+            diff);
+    }
+
+    {
+        const double diff = std::fabs(logsumexp_scalar(logprobs_ref.data() + tok_beg, n_ts) - logsumexp_vec(logprobs.data() + tok_beg, n_ts, probs.data()));
+
+        bench("ts_logsumexp",
+            [&]() { sum += logsumexp_scalar(logprobs_ref.data() + tok_beg, n_ts); },
+            [&]() { sum += logsumexp_vec   (logprobs.data() + tok_beg, n_ts, probs.data()); },
+            diff);
+    }
+
+    // keeps the results alive
+    fprintf(stderr, "sum:    %f\n", sum);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -168,6 +334,7 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_logits();                       break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -50,6 +50,10 @@ struct whisper_params {
     int32_t keep_ms    = 200;
     int32_t capture_id = -1;
     int32_t audio_ctx     = 0;
+    int32_t encode_batch  = 0;
+    int32_t n_draft       = 4;
+    int32_t rep_n_tokens  = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).rep_n_tokens;
+    int32_t rep_ngram_max = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).rep_ngram_max;
 
     float vad_thold  = 0.4f;
     float freq_thold = 100.0f;
@@ -86,6 +90,7 @@ struct whisper_params {
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "/etc/models/ggml-tiny.en.bin";
+    std::string model_draft;
     std::string grammar;
     std::string grammar_rule;
 
@@ -144,10 +149,13 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(ARGV_NEXT); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(ARGV_NEXT); }
         else if (arg == "-ac"   || arg == "--audio-ctx")       { params.audio_ctx       = std::stoi(ARGV_NEXT); }
+        else if (arg == "-eb"   || arg == "--encode-batch")    { params.encode_batch    = std::stoi(ARGV_NEXT); }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(ARGV_NEXT); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(ARGV_NEXT); }
+        else if (arg == "-rn"   || arg == "--rep-n-tokens")    { params.rep_n_tokens    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-rng"  || arg == "--rep-ngram-max")   { params.rep_ngram_max   = std::stoi(ARGV_NEXT); }
         else if (arg == "-tp"   || arg == "--temperature")     { params.temperature     = std::stof(ARGV_NEXT); }
         else if (arg == "-tpi"  || arg == "--temperature-inc") { params.temperature_inc = std::stof(ARGV_NEXT); }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
@@ -167,6 +175,8 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = ARGV_NEXT; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = ARGV_NEXT; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = ARGV_NEXT; }
+        else if (                  arg == "--draft")           { params.n_draft         = std::stoi(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
@@ -213,10 +223,13 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
     fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -eb N,     --encode-batch N    [%-7d] encode N fixed-stride 30 s windows at once (0 - off)\n", params.encode_batch);
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",                          params.no_speech_thold);
+    fprintf(stderr, "  -rn N,     --rep-n-tokens N    [%-7d] tokens repeated for early loop detection (0 - off)\n", params.rep_n_tokens);
+    fprintf(stderr, "  -rng N,    --rep-ngram-max N   [%-7d] max n-gram size for early loop detection\n",       params.rep_ngram_max);
     fprintf(stderr, "  -tp,       --temperature N     [%-7.2f] The sampling temperature, between 0 and 1\n",    params.temperature);
     fprintf(stderr, "  -tpi,      --temperature-inc N [%-7.2f] The increment of temperature, between 0 and 1\n",params.temperature_inc);
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
@@ -237,6 +250,8 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt (max n_text_ctx/2 tokens)\n",       params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input audio file path\n",                            "");
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative decoding\n",      params.model_draft.c_str());
+    fprintf(stderr, "             --draft N           [%-7d] number of tokens to draft for speculative decoding\n", params.n_draft);
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
@@ -319,6 +334,19 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    // [EXPERIMENTAL] speculative decoding with a smaller model
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file_with_params_no_state(params.model_draft.c_str(), cparams);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize the draft whisper context\n");
+            whisper_free(ctx);
+            return 3;
+        }
+    }
+
     if (!params.grammar.empty()) {
         auto & grammar = params.grammar_parsed;
         if (is_file_exist(params.grammar.c_str())) {
@@ -402,6 +430,7 @@ int main(int argc, char ** argv) {
         wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
         wparams.split_on_word    = params.split_on_word;
         wparams.audio_ctx        = params.audio_ctx;
+        wparams.encode_batch     = params.encode_batch;
 
         wparams.debug_mode       = params.debug_mode;
 
@@ -420,11 +449,16 @@ int main(int argc, char ** argv) {
         wparams.entropy_thold    = params.entropy_thold;
         wparams.logprob_thold    = params.logprob_thold;
         wparams.no_speech_thold  = params.no_speech_thold;
+        wparams.rep_n_tokens     = params.rep_n_tokens;
+        wparams.rep_ngram_max    = params.rep_ngram_max;
 
         wparams.no_timestamps    = params.no_timestamps;
 
         wparams.suppress_nst     = params.suppress_nst;
 
+        wparams.draft_ctx        = ctx_draft;
+        wparams.draft_n_tokens   = params.n_draft;
+
         wparams.vad            = params.vad;
         wparams.vad_model_path = params.vad_model.c_str();
 
@@ -581,6 +615,7 @@ int main(int argc, char ** argv) {
     if (!params.no_prints) {
         whisper_print_timings(ctx);
     }
+    whisper_free(ctx_draft);
     whisper_free(ctx);
 
     return 0;
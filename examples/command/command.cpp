@@ -328,6 +328,12 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
     }
     fprintf(stderr, " ]\n");
 
+    // only the logits of the command tokens are needed
+    std::vector<whisper_token> k_allowed;
+    for (const auto & tokens : allowed_tokens) {
+        k_allowed.insert(k_allowed.end(), tokens.begin(), tokens.end());
+    }
+
     fprintf(stderr, "\n");
     fprintf(stderr, "%s: listening for a command ...\n", __func__);
     fprintf(stderr, "\n");
@@ -370,6 +376,9 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
             wparams.prompt_tokens    = k_tokens.data();
             wparams.prompt_n_tokens  = k_tokens.size();
 
+            wparams.allowed_tokens   = k_allowed.data();
+            wparams.allowed_n_tokens = k_allowed.size();
+
             // run the transformer and a single decoding pass
             if (whisper_full(ctx, wparams, pcmf32_cur.data(), pcmf32_cur.size()) != 0) {
                 fprintf(stderr, "%s: ERROR: whisper_full() failed\n", __func__);
@@ -7,8 +7,10 @@
 
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -36,8 +38,10 @@ struct server_params
     int32_t port          = 8080;
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
+    int32_t n_parallel    = 1;
 
     bool ffmpeg_converter = false;
+    bool cont_batching    = false;
 };
 
 struct whisper_params {
@@ -135,6 +139,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
     fprintf(stderr, "  --inference-path PATH,         [%-7s] Inference path for all requests\n", sparams.inference_path.c_str());
     fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,     --parallel N        [%-7d] number of requests to process in parallel\n", sparams.n_parallel);
+    fprintf(stderr, "  -cb,       --cont-batching     [%-7s] merge the decoder steps of the parallel requests\n", sparams.cont_batching ? "true" : "false");
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n", params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",   params.no_speech_thold);
     fprintf(stderr, "  -nc,       --no-context        [%-7s] do not use previous audio context\n", params.no_context ? "true" : "false");
@@ -195,6 +201,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--inference-path")  { sparams.inference_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel  = std::stoi(argv[++i]); }
+        else if (arg == "-cb"   || arg == "--cont-batching")   { sparams.cont_batching = true; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
@@ -212,6 +220,113 @@ struct whisper_print_user_data {
     int progress_prev;
 };
 
+// a pool of whisper states sharing the weights of a single whisper context
+// requests wait in FIFO order until one of the states becomes available
+struct whisper_state_pool {
+    std::vector<whisper_state *> states;
+    std::vector<int> free_ids;
+
+    // optional - merges the decoder steps of the states that are in use
+    whisper_batch_sched * batch_sched = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    uint64_t n_tickets = 0; // number of requests that have entered the queue
+    uint64_t n_served  = 0; // number of requests that have left the queue
+
+    // must be called while no state is in use
+    bool init(struct whisper_context * ctx, int n_states, const std::string & openvino_encode_device, bool cont_batching, int n_threads) {
+        if (cont_batching && n_states > 1) {
+            batch_sched = whisper_batch_sched_init(ctx, n_states, n_threads);
+            if (batch_sched == nullptr) {
+                fprintf(stderr, "error: failed to initialize the batch scheduler\n");
+                return false;
+            }
+        }
+
+        for (int i = 0; i < n_states; ++i) {
+            struct whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper state %d\n", i);
+                return false;
+            }
+
+            // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+            whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, openvino_encode_device.c_str(), nullptr);
+
+            if (batch_sched) {
+                whisper_state_set_batch_sched(ctx, state, batch_sched);
+            }
+
+            states.push_back(state);
+            free_ids.push_back(i);
+        }
+
+        return true;
+    }
+
+    // must be called while no state is in use
+    void free() {
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+        states.clear();
+        free_ids.clear();
+
+        whisper_batch_sched_free(batch_sched);
+        batch_sched = nullptr;
+    }
+
+    // block until a state is available and return its index
+    int acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        const uint64_t ticket = n_tickets++;
+        cv.wait(lock, [&] { return ticket == n_served && !free_ids.empty(); });
+        n_served++;
+
+        const int id = free_ids.back();
+        free_ids.pop_back();
+
+        // let the next request in the queue check for a free state
+        cv.notify_all();
+
+        return id;
+    }
+
+    void release(int id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_ids.push_back(id);
+        }
+        cv.notify_all();
+    }
+
+    // block until all states are idle - new requests are queued while the returned lock is held
+    std::unique_lock<std::mutex> acquire_all() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        const uint64_t ticket = n_tickets++;
+        cv.wait(lock, [&] { return ticket == n_served && free_ids.size() == states.size(); });
+        n_served++;
+
+        return lock;
+    }
+};
+
+// RAII helper that holds one state of the pool for the duration of a request
+struct whisper_state_guard {
+    whisper_state_pool & pool;
+
+    const int id;
+
+    whisper_state_guard(whisper_state_pool & pool) : pool(pool), id(pool.acquire()) {}
+    ~whisper_state_guard() { pool.release(id); }
+
+    struct whisper_state * state() const { return pool.states[id]; }
+};
+
 void check_ffmpeg_availibility() {
     int result = system("ffmpeg -version");
 
@@ -311,11 +426,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -331,8 +446,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -344,29 +459,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -379,17 +494,17 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+std::string output_str(struct whisper_state * state, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -519,8 +634,6 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
-
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
@@ -538,6 +651,17 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    if (params.n_processors > 1) {
+        fprintf(stderr, "warning: --processors is not supported by the server, use --parallel to process requests concurrently\n");
+        params.n_processors = 1;
+    }
+
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
@@ -591,17 +715,31 @@ int main(int argc, char ** argv) {
         }
     }
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    // the model weights are shared by all states in the pool
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
 
     if (ctx == nullptr) {
         fprintf(stderr, "error: failed to initialize whisper context\n");
         return 3;
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    whisper_state_pool pool;
+
+    if (!pool.init(ctx, sparams.n_parallel, params.openvino_encode_device, sparams.cont_batching, params.n_threads)) {
+        fprintf(stderr, "error: failed to initialize whisper state pool\n");
+        return 3;
+    }
+
+    // split the threads between the requests that run in parallel
+    const int32_t n_threads_per_request = std::max(1, params.n_threads / sparams.n_parallel);
 
     Server svr;
+
+    // make sure there are enough HTTP workers to keep all states busy
+    svr.new_task_queue = [&sparams] {
+        return new ThreadPool(std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, sparams.n_parallel + 1));
+    };
+
     svr.set_default_headers({{"Server", "whisper.cpp"},
                              {"Access-Control-Allow-Origin", "*"},
                              {"Access-Control-Allow-Headers", "content-type, authorization"}});
@@ -690,8 +828,8 @@ int main(int argc, char ** argv) {
     });
 
     svr.Post(sparams.request_path + sparams.inference_path, [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // each request works on its own copy of the parameters
+        whisper_params params = default_params;
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -751,11 +889,18 @@ int main(int argc, char ** argv) {
 
         printf("Successfully loaded %s\n", filename.c_str());
 
+        // wait for a free whisper state - the audio above is decoded without holding one
+        whisper_state_guard guard(pool);
+
+        struct whisper_state * state = guard.state();
+
+        params.n_threads = n_threads_per_request;
+
         // print system information
         {
             fprintf(stderr, "\n");
             fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+                    params.n_threads*sparams.n_parallel, std::thread::hardware_concurrency(), whisper_print_system_info());
         }
 
         // print some info about the processing
@@ -771,9 +916,9 @@ int main(int argc, char ** argv) {
             if (params.detect_language) {
                 params.language = "auto";
             }
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
+            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, state %d / %d, lang = %s, task = %s, %stimestamps = %d ...\n",
                     __func__, filename.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors,
+                    params.n_threads, guard.id, sparams.n_parallel,
                     params.language.c_str(),
                     params.translate ? "translate" : "transcribe",
                     params.tinydiarize ? "tdrz = 1, " : "",
@@ -848,7 +993,7 @@ int main(int argc, char ** argv) {
             };
             wparams.abort_callback_user_data = (void*)&req;
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
                 // handle failure or early abort
                 if (req.is_connection_closed()) {
                     // log client disconnect
@@ -868,17 +1013,17 @@ int main(int argc, char ** argv) {
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             res.set_content(results.c_str(), "text/html; charset=utf-8");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -896,11 +1041,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -916,13 +1061,13 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s); 
+            std::string results = output_str(state, params, pcmf32s); 
             // Get language probabilities
             std::vector<float> lang_probs(whisper_lang_max_id() + 1, 0.0f);
-            const auto detected_lang_id = whisper_lang_auto_detect(ctx, 0, params.n_threads, lang_probs.data());
+            const auto detected_lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, lang_probs.data());
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
+                {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(state))},
                 {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
                 {"text", results},
                 {"segments", json::array()},
@@ -936,29 +1081,29 @@ int main(int argc, char ** argv) {
                     jres["language_probabilities"][whisper_lang_str(i)] = lang_probs[i];
                 }
             }
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i)
             {
                 json segment = json{
                     {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
+                    {"text", whisper_full_get_segment_text_from_state(state, i)},
                 };
 
                 if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+                    segment["start"] = whisper_full_get_segment_t0_from_state(state, i) * 0.01;
+                    segment["end"] = whisper_full_get_segment_t1_from_state(state, i) * 0.01;
                 }
 
                 float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
+                const int n_tokens = whisper_full_n_tokens_from_state(state, i);
                 for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
+                    whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
                     if (token.id >= whisper_token_eot(ctx)) {
                         continue;
                     }
 
                     segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
+                    json word = json{{"word", whisper_full_get_token_text_from_state(ctx, state, i, j)}};
                     if (!params.no_timestamps) {
                         word["start"] = token.t0 * 0.01;
                         word["end"] = token.t1 * 0.01;
@@ -974,7 +1119,7 @@ int main(int argc, char ** argv) {
 
                 // TODO compression_ratio and no_speech_prob are not implemented yet
                 // segment["compression_ratio"] = 0;
-                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob(ctx, i);
+                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob_from_state(state, i);
 
                 jres["segments"].push_back(segment);
             }
@@ -984,19 +1129,15 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             json jres = json{
                 {"text", results}
             };
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
         }
-
-        // reset params to their defaults
-        params = default_params;
     });
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -1013,21 +1154,22 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        // wait for the in-flight requests to finish, new requests are queued until the model is replaced
+        auto lock = pool.acquire_all();
+
         // clean up
+        pool.free();
         whisper_free(ctx);
 
         // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+        ctx = whisper_init_from_file_with_params_no_state(model.c_str(), cparams);
 
         // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
+        if (ctx == nullptr || !pool.init(ctx, sparams.n_parallel, params.openvino_encode_device, sparams.cont_batching, params.n_threads)) {
             fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
             exit(1);
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
-
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
 
@@ -1085,6 +1227,7 @@ int main(int argc, char ** argv) {
     }
 
     whisper_print_timings(ctx);
+    pool.free();
     whisper_free(ctx);
 
     return 0;
@@ -0,0 +1,248 @@
+// Streaming transcription of an audio file with the whisper_stream API
+//
+// The audio is pushed in small chunks, optionally at real-time speed, as if it was captured from a microphone.
+// This makes it possible to test the streaming transcription offline and to measure the latency of each push.
+//
+#include "common.h"
+#include "common-whisper.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// command-line parameters
+struct whisper_params {
+    int32_t n_threads  = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t chunk_ms   = 100;
+    int32_t step_ms    = 1000;
+    int32_t buffer_ms  = 15000;
+    int32_t n_agree    = 2;
+    int32_t audio_ctx  = 0;
+    int32_t beam_size  = -1;
+
+    bool real_time     = false;
+    bool full_ctx      = false;
+    bool print_partial = false;
+    bool no_prints     = false;
+    bool use_gpu       = true;
+    bool flash_attn    = false;
+
+    std::string language  = "en";
+    std::string model     = "models/ggml-base.en.bin";
+    std::string fname_inp;
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+static bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"    || arg == "--threads")       { params.n_threads     = std::stoi(argv[++i]); }
+        else if (                  arg == "--chunk")         { params.chunk_ms      = std::stoi(argv[++i]); }
+        else if (                  arg == "--step")          { params.step_ms       = std::stoi(argv[++i]); }
+        else if (                  arg == "--buffer")        { params.buffer_ms     = std::stoi(argv[++i]); }
+        else if (                  arg == "--agree")         { params.n_agree       = std::stoi(argv[++i]); }
+        else if (arg == "-ac"   || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
+        else if (arg == "-bs"   || arg == "--beam-size")     { params.beam_size     = std::stoi(argv[++i]); }
+        else if (arg == "-rt"   || arg == "--real-time")     { params.real_time     = true; }
+        else if (arg == "-fc"   || arg == "--full-ctx")      { params.full_ctx      = true; }
+        else if (arg == "-pp"   || arg == "--print-partial") { params.print_partial = true; }
+        else if (arg == "-np"   || arg == "--no-prints")     { params.no_prints     = true; }
+        else if (arg == "-l"    || arg == "--language")      { params.language      = argv[++i]; }
+        else if (arg == "-m"    || arg == "--model")         { params.model         = argv[++i]; }
+        else if (arg == "-f"    || arg == "--file")          { params.fname_inp     = argv[++i]; }
+        else if (arg == "-ng"   || arg == "--no-gpu")        { params.use_gpu       = false; }
+        else if (arg == "-fa"   || arg == "--flash-attn")    { params.flash_attn    = true; }
+
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options] -f FNAME\n", argv[0]);
+    fprintf(stderr, "supported audio formats: flac, mp3, ogg, wav\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,     --threads N     [%-7d] number of threads to use during computation\n",       params.n_threads);
+    fprintf(stderr, "            --chunk N       [%-7d] audio pushed at once in milliseconds\n",              params.chunk_ms);
+    fprintf(stderr, "            --step N        [%-7d] new audio between transcriptions in milliseconds\n",  params.step_ms);
+    fprintf(stderr, "            --buffer N      [%-7d] audio length before trimming in milliseconds\n",      params.buffer_ms);
+    fprintf(stderr, "            --agree N       [%-7d] transcriptions that must agree to commit a token\n",  params.n_agree);
+    fprintf(stderr, "  -ac N,    --audio-ctx N   [%-7d] maximum audio context size (0 - all)\n",              params.audio_ctx);
+    fprintf(stderr, "  -bs N,    --beam-size N   [%-7d] beam size for beam search\n",                         params.beam_size);
+    fprintf(stderr, "  -rt,      --real-time     [%-7s] push the audio at real-time speed\n",                 params.real_time ? "true" : "false");
+    fprintf(stderr, "  -fc,      --full-ctx      [%-7s] always encode a full 30 s window\n",                  params.full_ctx ? "true" : "false");
+    fprintf(stderr, "  -pp,      --print-partial [%-7s] print the partial text after each transcription\n",   params.print_partial ? "true" : "false");
+    fprintf(stderr, "  -np,      --no-prints     [%-7s] do not print anything other than the results\n",      params.no_prints ? "true" : "false");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n",                                   params.language.c_str());
+    fprintf(stderr, "  -m FNAME, --model FNAME   [%-7s] model path\n",                                        params.model.c_str());
+    fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] input audio file path\n",                             params.fname_inp.c_str());
+    fprintf(stderr, "  -ng,      --no-gpu        [%-7s] disable GPU inference\n",                             params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -fa,      --flash-attn    [%-7s] flash attention during inference\n",                  params.flash_attn ? "true" : "false");
+    fprintf(stderr, "\n");
+}
+
+static void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
+
+static void print_committed(struct whisper_stream * stream, int n_new) {
+    const int n_committed = whisper_stream_n_committed(stream);
+
+    for (int i = n_committed - n_new; i < n_committed; ++i) {
+        printf("[%s --> %s]  %s\n",
+                to_timestamp(whisper_stream_get_committed_t0(stream, i)).c_str(),
+                to_timestamp(whisper_stream_get_committed_t1(stream, i)).c_str(),
+                whisper_stream_get_committed_text(stream, i));
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.fname_inp.empty()) {
+        fprintf(stderr, "error: no input file\n");
+        whisper_print_usage(argc, argv, params);
+        return 1;
+    }
+
+    if (params.no_prints) {
+        whisper_log_set(cb_log_disable, NULL);
+    }
+
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+    if (!read_audio_data(params.fname_inp, pcmf32, pcmf32s, false)) {
+        fprintf(stderr, "error: failed to read audio data from %s\n", params.fname_inp.c_str());
+        return 2;
+    }
+
+    // whisper init
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = params.flash_attn;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 3;
+    }
+
+    whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_special    = false;
+    wparams.print_timestamps = false;
+    wparams.translate        = false;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    whisper_stream_params sparams = whisper_stream_default_params();
+
+    sparams.step_ms          = params.step_ms;
+    sparams.buffer_ms        = params.buffer_ms;
+    sparams.n_agree          = params.n_agree;
+    sparams.reduce_audio_ctx = !params.full_ctx;
+
+    struct whisper_stream * stream = whisper_stream_init(ctx, wparams, sparams);
+    if (stream == nullptr) {
+        fprintf(stderr, "error: failed to initialize the stream\n");
+        whisper_free(ctx);
+        return 4;
+    }
+
+    const int n_samples_chunk = std::max(1, (int) ((1e-3*params.chunk_ms)*WHISPER_SAMPLE_RATE));
+
+    if (!params.no_prints) {
+        fprintf(stderr, "%s: processing %d samples (%.1f sec), pushing %d ms chunks%s, step = %d ms, buffer = %d ms, agree = %d ...\n",
+                __func__, (int) pcmf32.size(), float(pcmf32.size())/WHISPER_SAMPLE_RATE, params.chunk_ms,
+                params.real_time ? " at real-time speed" : "", params.step_ms, params.buffer_ms, params.n_agree);
+        fprintf(stderr, "\n");
+    }
+
+    int    n_push     = 0;
+    double t_push_sum = 0.0;
+    double t_push_max = 0.0;
+
+    std::string partial;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < pcmf32.size(); i += n_samples_chunk) {
+        const int n = std::min<size_t>(n_samples_chunk, pcmf32.size() - i);
+
+        if (params.real_time) {
+            // the chunk is available once it has been "recorded"
+            std::this_thread::sleep_until(t_start + std::chrono::microseconds((int64_t) (i + n)*1000000/WHISPER_SAMPLE_RATE));
+        }
+
+        const auto t0 = std::chrono::steady_clock::now();
+
+        const int n_new = whisper_stream_push(stream, pcmf32.data() + i, n);
+
+        const double t_push = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        if (n_new < 0) {
+            fprintf(stderr, "error: failed to process the audio\n");
+            break;
+        }
+
+        n_push++;
+        t_push_sum += t_push;
+        t_push_max  = std::max(t_push_max, t_push);
+
+        print_committed(stream, n_new);
+
+        if (params.print_partial && (n_new > 0 || partial != whisper_stream_get_partial_text(stream))) {
+            partial = whisper_stream_get_partial_text(stream);
+
+            fprintf(stderr, "[%s] partial: %s\n", to_timestamp((i + n)*100/WHISPER_SAMPLE_RATE).c_str(), partial.c_str());
+        }
+    }
+
+    const int n_new = whisper_stream_flush(stream);
+    if (n_new > 0) {
+        print_committed(stream, n_new);
+    }
+
+    if (!params.no_prints) {
+        const double t_total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: %d pushes, latency per push: avg = %8.2f ms, max = %8.2f ms\n", __func__, n_push, n_push > 0 ? t_push_sum/n_push : 0.0, t_push_max);
+        fprintf(stderr, "%s: total time = %8.2f ms, audio = %8.2f ms\n", __func__, t_total, 1e3*pcmf32.size()/WHISPER_SAMPLE_RATE);
+    }
+
+    whisper_stream_free(stream);
+    whisper_free(ctx);
+
+    return 0;
+}
@@ -168,6 +168,9 @@ int main(int argc, char ** argv) {
 
     std::vector<whisper_token> prompt_tokens;
 
+    // in sliding window mode, only the mel frames of the new audio are computed at each step
+    struct whisper_mel_stream * mel_stream = use_vad ? nullptr : whisper_mel_stream_init(ctx, params.n_threads);
+
     // print some info about the processing
     {
         fprintf(stderr, "\n");
@@ -281,6 +284,10 @@ int main(int argc, char ** argv) {
             memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new*sizeof(float));
 
             pcmf32_old = pcmf32;
+
+            // the window can start up to WHISPER_HOP_LENGTH samples before pcmf32, so that the mel frames stay aligned
+            whisper_mel_stream_push(mel_stream, pcmf32_new.data(), n_samples_new);
+            whisper_mel_stream_drop(mel_stream, whisper_mel_stream_n_samples(mel_stream) - (int) pcmf32.size());
         } else {
             const auto t_now  = std::chrono::high_resolution_clock::now();
             const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
@@ -330,7 +337,11 @@ int main(int argc, char ** argv) {
             wparams.prompt_tokens    = params.no_context ? nullptr : prompt_tokens.data();
             wparams.prompt_n_tokens  = params.no_context ? 0       : prompt_tokens.size();
 
-            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            const int ret = mel_stream ?
+                (whisper_mel_stream_set(ctx, mel_stream) == 0 ? whisper_full(ctx, wparams, nullptr, 0) : -1) :
+                 whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size());
+
+            if (ret != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 6;
             }
@@ -423,6 +434,7 @@ int main(int argc, char ** argv) {
     audio.pause();
 
     whisper_print_timings(ctx);
+    whisper_mel_stream_free(mel_stream);
     whisper_free(ctx);
 
     return 0;
@@ -118,6 +118,10 @@ extern "C" {
 
     GGML_BACKEND_API const struct ggml_type_traits_cpu * ggml_get_type_traits_cpu(enum ggml_type type);
 
+    // vectorized soft_max of a row: y = exp(x - max), returns sum(y)
+    // obtained with ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_vec_soft_max_f32")
+    typedef double (*ggml_backend_cpu_vec_soft_max_f32_t)(int n, float * y, const float * x, float max);
+
     GGML_BACKEND_API void ggml_cpu_init(void);
 
     //
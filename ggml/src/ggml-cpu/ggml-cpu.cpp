@@ -5,6 +5,7 @@
 #include "ggml-cpu-traits.h"
 #include "ggml-impl.h"
 #include "amx/amx.h"
+#include "vec.h"
 
 #include <cctype>
 #include <string>
@@ -631,6 +632,10 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_vec_soft_max_f32") == 0) {
+        ggml_backend_cpu_vec_soft_max_f32_t fct = ggml_vec_soft_max_f32;
+        return (void *)fct;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
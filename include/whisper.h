@@ -79,6 +79,7 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_batch_sched;
     struct whisper_full_params;
 
     typedef int32_t whisper_pos;
@@ -126,6 +127,9 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        bool use_mmap;  // map the model file instead of reading it (whisper_init_from_file_with_params only)
+        bool use_mlock; // lock the mapped model file in memory
     };
 
     typedef struct whisper_token_data {
@@ -238,6 +242,27 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // [EXPERIMENTAL] Continuous batching of the decoder across states
+    // States of the same context that are attached to a batch scheduler merge their pending decoder steps
+    // into a single decoder graph evaluation. Each state keeps its own self- and cross-attention KV caches.
+    // Useful when several threads run whisper_full_with_state() concurrently on states of the same context.
+    //   n_states_max: maximum number of states merged into a single decoder evaluation
+    //   n_threads:    number of threads used to evaluate the merged decoder graph
+    WHISPER_API struct whisper_batch_sched * whisper_batch_sched_init(
+        struct whisper_context * ctx,
+                           int   n_states_max,
+                           int   n_threads);
+
+    WHISPER_API void whisper_batch_sched_free(struct whisper_batch_sched * bsched);
+
+    // Attach a state to a batch scheduler. Pass NULL to detach it.
+    // The scheduler must outlive all states attached to it.
+    // Returns 0 on success
+    WHISPER_API int whisper_state_set_batch_sched(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_batch_sched * bsched);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -301,6 +326,49 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // [EXPERIMENTAL] Incremental log mel spectrogram for streaming input.
+    // The samples are pushed as they arrive and only the mel frames that became complete are computed.
+    // Samples at the start of the stream that are no longer needed are dropped with whisper_mel_stream_drop().
+    // whisper_mel_stream_set() sets the log mel spectrogram of the retained samples - the same result as
+    // whisper_pcm_to_mel() on these samples - so they can be transcribed with whisper_full(ctx, params, nullptr, 0).
+    // The signal energy used to refine the token-level timestamps is not available in this mode.
+    // The context must outlive the stream.
+    struct whisper_mel_stream;
+
+    WHISPER_API struct whisper_mel_stream * whisper_mel_stream_init(
+            struct whisper_context * ctx,
+                               int   n_threads);
+
+    WHISPER_API void whisper_mel_stream_free(struct whisper_mel_stream * stream);
+
+    // Append n_samples samples to the stream.
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_push(
+         struct whisper_mel_stream * stream,
+                       const float * samples,
+                               int   n_samples);
+
+    // Drop up to n_samples samples from the start of the retained samples.
+    // The number is rounded down to a multiple of WHISPER_HOP_LENGTH, so that the frames stay aligned.
+    // Returns the number of dropped samples
+    WHISPER_API int whisper_mel_stream_drop(
+         struct whisper_mel_stream * stream,
+                               int   n_samples);
+
+    // Number of retained samples
+    WHISPER_API int whisper_mel_stream_n_samples(const struct whisper_mel_stream * stream);
+
+    // Set the log mel spectrogram of the retained samples inside the default state of the provided whisper context.
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_set(
+            struct whisper_context * ctx,
+         struct whisper_mel_stream * stream);
+
+    WHISPER_API int whisper_mel_stream_set_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+         struct whisper_mel_stream * stream);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -316,6 +384,19 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // [EXPERIMENTAL] Run the Whisper encoder on one window of each of the given states in a single batch.
+    // The windows are stacked along the batch dimension and the cross-attention memory of each window is stored
+    // in the corresponding state, as if whisper_encode_with_state(ctx, states[i], offsets[i], n_threads) was called.
+    // The states must be distinct and must not be in use by other threads during the call.
+    // The compute buffer of the batch is kept in states[0] and is reused by subsequent calls.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+                         const int * offsets,
+                               int   n_states,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -439,6 +520,17 @@ extern "C" {
         float decode_ms;
         float batchd_ms;
         float prompt_ms;
+
+        // model loading: total and per phase (hparams, vocab and tensor headers / tensor allocation / tensor data)
+        float load_ms;
+        float load_meta_ms;
+        float load_alloc_ms;
+        float load_data_ms;
+
+        // [EXPERIMENTAL] speculative decoding: time spent in the draft model, number of proposed / accepted draft tokens
+        float draft_ms;
+        int   draft_n;
+        int   draft_n_accept;
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
@@ -511,6 +603,11 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool mel_window;        // compute the mel spectrogram one window at a time - bounded memory, normalized per window
+        bool greedy_on_device;  // greedy at t == 0: suppress and reduce the logits in the decoder graph, only the argmax and
+                                // the statistics are copied to the host (whisper_get_logits() is not updated for these tokens)
+        int  encode_batch;      // encode up to encode_batch windows at once (0 - off) - the audio is transcribed in fixed-stride
+                                // windows of 2*audio_ctx frames (30 s by default) instead of following the timestamps
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -545,6 +642,14 @@ extern "C" {
         float logprob_thold;
         float no_speech_thold;
 
+        // [EXPERIMENTAL] early repetition-loop detection
+        // a decoder fails as soon as its last rep_n_tokens tokens repeat the same n-gram of up to rep_ngram_max tokens
+        // all timestamp tokens count as the same token, so this can fail decoders that would otherwise pass the
+        // entropy check - e.g. rep_n_tokens = 48, rep_ngram_max = 8
+        // (0 - disabled, the loop is then detected only when the segment reaches the maximum number of tokens)
+        int rep_n_tokens;
+        int rep_ngram_max;
+
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
         } greedy;
@@ -552,7 +657,10 @@ extern "C" {
         struct {
             int beam_size;  // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L265
 
-            float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
+            // a beam that finishes continues with the next best candidate until round(patience*beam_size) sequences have
+            // finished, then the best of them is selected - same as OpenAI's implementation
+            // (<= 0.0f - each beam finishes once and the search ends when all of them have), ref: https://arxiv.org/pdf/2204.05424.pdf
+            float patience;
         } beam_search;
 
         // called for every newly generated text segment
@@ -580,6 +688,17 @@ extern "C" {
         size_t                           i_start_rule;
         float                            grammar_penalty;
 
+        // [EXPERIMENTAL] restricted vocabulary - the decoder computes the logits only for these tokens and all other
+        // tokens are suppressed. EOT and (unless no_timestamps) the timestamp tokens are always allowed. The prompt is
+        // still decoded over the full vocabulary, so the no_speech_prob does not depend on the allowed tokens
+        const whisper_token * allowed_tokens;
+        int                   allowed_n_tokens;
+
+        // [EXPERIMENTAL] speculative decoding - a smaller model with the same vocabulary proposes draft_n_tokens tokens,
+        // which the main model verifies in a single decoder pass. Greedy at t == 0 only - the output does not change
+        struct whisper_context * draft_ctx;
+        int                      draft_n_tokens;
+
         // Voice Activity Detection (VAD) params
         bool         vad;                         // Enable VAD
         const char * vad_model_path;              // Path to VAD model
@@ -610,6 +729,85 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // [EXPERIMENTAL] Pull-based audio input
+    // Reads up to n_samples mono 16 kHz float PCM samples that follow the previously read ones into dst
+    // Returns the number of samples read, 0 at the end of the audio or a negative value on error
+    typedef int (*whisper_audio_read_callback)(float * dst, int n_samples, void * user_data);
+
+    struct whisper_audio_source {
+        whisper_audio_read_callback read;
+        void * user_data;
+    };
+
+    // [EXPERIMENTAL] Same as whisper_full(), but the audio is pulled from the source as the transcription advances
+    // Only about one window of audio is kept in memory, so the input can be a pipe or a recording that does not fit
+    // in RAM. The mel spectrogram is computed one window at a time (see whisper_full_params.mel_window).
+    // VAD is not supported. With token_timestamps, the signal energy is kept only for the samples of the current window
+    // and the 1/8 s of audio before it (4 bytes per sample).
+    // The progress callback reports 0 until the end of the audio has been read.
+    WHISPER_API int whisper_full_from_source(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+           struct whisper_audio_source   source);
+
+    WHISPER_API int whisper_full_from_source_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+           struct whisper_audio_source   source);
+
+    // [EXPERIMENTAL] Streaming transcription
+    // The audio is pushed in chunks as it arrives. Once step_ms of new audio has been pushed, the retained audio is
+    // transcribed again and the leading tokens on which the last n_agree transcriptions agree are committed
+    // (LocalAgreement policy). The committed segments never change. The rest of the last transcription is the partial
+    // text, which can still change as more audio arrives.
+    // A push transcribes at most once and the retained audio is trimmed at the end of a committed segment once it is
+    // longer than buffer_ms, so the work per push is bounded:
+    //   - the mel spectrogram of the pushed samples is computed incrementally (see whisper_mel_stream)
+    //   - with reduce_audio_ctx, the encoder runs only on the retained audio instead of a full 30 s window
+    //   - only the committed text that precedes the retained audio is passed to the decoder as prompt
+    // The stream has its own state, so several streams can run on the same context in parallel.
+    // The timestamps are in units of 10 ms from the start of the stream.
+    struct whisper_stream_params {
+        int  step_ms;          // transcribe after this much new audio has been pushed
+        int  buffer_ms;        // trim the retained audio once it is longer than this
+        int  n_agree;          // number of consecutive transcriptions that must agree on a token to commit it
+        bool reduce_audio_ctx; // set the audio context from the length of the retained audio (whisper_full_params.audio_ctx is the upper limit)
+    };
+
+    WHISPER_API struct whisper_stream_params whisper_stream_default_params(void);
+
+    struct whisper_stream;
+
+    // The language, sampling strategy, initial prompt, etc. are taken from params.
+    // The context must outlive the stream.
+    WHISPER_API struct whisper_stream * whisper_stream_init(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+          struct whisper_stream_params   stream_params);
+
+    WHISPER_API void whisper_stream_free(struct whisper_stream * stream);
+
+    // Append n_samples mono 16 kHz float PCM samples and transcribe if step_ms of new audio has been pushed.
+    // Returns the number of newly committed segments or a negative value on error
+    WHISPER_API int whisper_stream_push(
+                struct whisper_stream * stream,
+                          const float * samples,
+                                  int   n_samples);
+
+    // End of the input: transcribe the remaining audio and commit the partial text.
+    // Returns the number of newly committed segments or a negative value on error
+    WHISPER_API int whisper_stream_flush(struct whisper_stream * stream);
+
+    // Committed segments - a segment is the text committed by one transcription
+    WHISPER_API int          whisper_stream_n_committed          (struct whisper_stream * stream);
+    WHISPER_API const char * whisper_stream_get_committed_text   (struct whisper_stream * stream, int i_segment);
+    WHISPER_API int64_t      whisper_stream_get_committed_t0     (struct whisper_stream * stream, int i_segment);
+    WHISPER_API int64_t      whisper_stream_get_committed_t1     (struct whisper_stream * stream, int i_segment);
+
+    // The uncommitted text of the last transcription
+    WHISPER_API const char * whisper_stream_get_partial_text(struct whisper_stream * stream);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
@@ -5,6 +5,7 @@
 #include "ggml-cpp.h"
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
+#include "ggml-cpu.h"
 
 #ifdef WHISPER_USE_COREML
 #include "coreml/whisper-encoder.h"
@@ -17,25 +18,40 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cfloat>
+#include <chrono>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <climits>
 #include <codecvt>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <regex>
-#include <set>
 #include <string>
 #include <thread>
 #include <vector>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -138,6 +154,7 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
     } while (0)
 
 #define WHISPER_MAX_DECODERS 8
+#define WHISPER_MAX_SEQ      WHISPER_MAX_DECODERS // one self-attention KV sequence per decoder
 #define WHISPER_MAX_NODES 4096
 
 static std::string format(const char * fmt, ...) {
@@ -458,14 +475,48 @@ struct whisper_mel {
     int n_len_org;
     int n_mel;
 
+    // data holds the frames [offset, offset + n_frames)
+    // this is the whole spectrogram, unless it is computed one window at a time
+    int offset   = 0;
+    int n_frames = 0;
+
     std::vector<float> data;
 };
 
+// [EXPERIMENTAL] source audio for computing the mel spectrogram one window at a time
+struct whisper_mel_source {
+    const float * samples = nullptr; // owned by the caller - only valid during whisper_full()
+    int n_samples = 0;               // with a reader: the number of samples read so far
+    int n_threads = 1;
+
+    // pull-based input - only the samples [buf_offset, buf_offset + buf.size()) are kept in memory
+    whisper_audio_source reader = { nullptr, nullptr };
+
+    bool eof      = false;
+    bool energy   = false; // compute the signal energy of the samples as they are read (token_timestamps)
+    int  n_energy = 0;
+
+    int buf_offset = 0;
+
+    std::vector<float> buf;
+    std::vector<float> head; // the first samples of the audio, for the reflective padding
+
+    // log-mel frames of the current window before normalization - reused when the window moves
+    int offset   = 0;
+    int n_frames = 0;
+
+    std::vector<float> raw;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // filter j is non-zero only for the bins [span_begin[j], span_end[j]), computed at load time
+    std::vector<int32_t> span_begin;
+    std::vector<int32_t> span_end;
 };
 
 struct whisper_vocab {
@@ -731,13 +782,18 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
+// bit i of the sequence mask is set if the cell belongs to sequence i
+typedef uint32_t whisper_seq_mask;
+
+static_assert(WHISPER_MAX_SEQ <= 8*sizeof(whisper_seq_mask), "WHISPER_MAX_SEQ does not fit in whisper_seq_mask");
+
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    whisper_seq_mask seq = 0;
 
     bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return (seq >> id) & 1;
     }
 };
 
@@ -745,11 +801,26 @@ struct whisper_kv_cache {
     uint32_t head = 0;
     uint32_t size = 0;
 
+    int64_t n_state = 0;
+    int64_t n_layer = 0;
+
     // computed before each graph build
     uint32_t n = 0;
 
+    // the cells are modified only through whisper_kv_cache_cell_set(), which keeps the fields below in sync
     std::vector<whisper_kv_cell> cells;
 
+    uint32_t used  = 0; // number of cells that belong to at least one sequence
+    uint32_t n_max = 0; // 1 + the index of the last used cell
+
+    // KQ mask row of each sequence: 0 for the cells of the sequence, -INF otherwise ([WHISPER_MAX_SEQ][size])
+    std::vector<float> seq_mask;
+
+    // upper bound of the positions of each sequence - if the tokens of a batch are past it, the KQ mask is built
+    // from the rows above (see whisper_kv_cache_build_mask)
+    whisper_pos seq_pos_max[WHISPER_MAX_SEQ];
+    bool        causal = false;
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -758,6 +829,73 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// read-only mapping of the model file
+// weights in CPU memory that are suitably aligned in the file point directly into the mapping
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    size_t pos = 0; // read cursor of the model loader
+
+    bool locked = false;
+
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+    static constexpr bool SUPPORTED = true;
+
+    bool open(const char * fname, bool lock) {
+        const int fd = ::open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+
+        size = st.st_size;
+
+        addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (addr == MAP_FAILED) {
+            addr = nullptr;
+            return false;
+        }
+
+        if (posix_madvise(addr, size, POSIX_MADV_WILLNEED)) {
+            WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+        }
+
+        if (lock) {
+            if (mlock(addr, size) == 0) {
+                locked = true;
+            } else {
+                WHISPER_LOG_WARN("%s: failed to mlock %zu bytes: %s - try increasing RLIMIT_MEMLOCK (ulimit -l)\n", __func__, size, strerror(errno));
+            }
+        }
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (addr) {
+            if (locked) {
+                munlock(addr, size);
+            }
+            munmap(addr, size);
+        }
+    }
+#else
+    static constexpr bool SUPPORTED = false;
+
+    bool open(const char * /*fname*/, bool /*lock*/) {
+        return false;
+    }
+#endif
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -798,6 +936,9 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     std::vector<ggml_backend_buffer_t> buffers;
 
+    // the mapped model file - set when the model is loaded with use_mmap
+    std::unique_ptr<whisper_mmap> mapping;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -833,8 +974,16 @@ struct whisper_sequence {
     double avg_logprobs;     // the average log probability of the tokens
     double entropy;          // the entropy of the tokens
     double score;            // likelihood rank score
+
+    uint64_t hash; // hash of the token ids - maintained only by the beam search
 };
 
+static const uint64_t WHISPER_SEQUENCE_HASH_INIT = 1469598103934665603ULL;
+
+static uint64_t whisper_sequence_hash_add(uint64_t hash, whisper_token id) {
+    return (hash ^ (uint64_t) id)*1099511628211ULL;
+}
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -855,6 +1004,12 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
+    // [EXPERIMENTAL] greedy_on_device - the logits of the last whisper_decode were reduced in the decoder graph
+    // only [token_eot, n_vocab) of the arrays above is valid, the text tokens are represented by their argmax
+    bool  reduced = false;
+    int   reduced_text_id;
+    float reduced_text_logprob;
+
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
 
@@ -868,6 +1023,162 @@ struct whisper_aheads_masks {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// the part of the logits suppression in whisper_process_logits() that depends only on the vocab and the params
+// it is built once per whisper_full() call and applied as a bias of 0 or -INFINITY per token
+struct whisper_logits_suppress {
+    // the params that the biases were built for
+    std::string suppress_regex;
+    bool        suppress_nst  = false;
+    bool        no_timestamps = false;
+    bool        tdrz_enable   = false;
+
+    // [EXPERIMENTAL] restricted vocabulary - sorted, including the tokens that are always allowed (empty = all tokens)
+    std::vector<whisper_token> allowed;
+
+    std::vector<float> bias_pre;  // applied before the logits_filter_callback
+    std::vector<float> bias_post; // applied after the logits_filter_callback
+};
+
+// [EXPERIMENTAL] greedy_on_device - the static suppression and the reduction over the text tokens are computed in the
+// decoder graph, so only the argmax and the statistics of the text tokens and the logits of the remaining tokens
+// [token_eot, n_vocab) are copied back to the host for each generated token
+struct whisper_logits_reduce {
+    bool enabled = false; // reduce the logits of the next single-token whisper_decode
+
+    // bias_pre + bias_post of whisper_logits_suppress, uploaded by whisper_logits_reduce_init()
+    struct ggml_tensor  * bias   = nullptr;
+    struct ggml_context * ctx    = nullptr;
+    ggml_backend_buffer_t buffer = nullptr;
+
+    // result of the last reduced whisper_decode
+    int   text_id  = 0;         // argmax of the suppressed text logits [0, token_eot)
+    float text_max = -INFINITY; // max of the suppressed text logits
+    float text_lse = -INFINITY; // logsumexp of the suppressed text logits
+
+    std::vector<float> tail; // suppressed logits [token_eot, n_vocab)
+};
+
+// [EXPERIMENTAL] restricted vocabulary (whisper_full_params.allowed_tokens) - the output projection of the decoder
+// gathers only the token embeddings of the allowed tokens, the logits of the other tokens are set to -INFINITY
+struct whisper_logits_restrict {
+    bool enabled = false; // restrict the logits of the next whisper_decode
+
+    // whisper_logits_suppress.allowed, uploaded by whisper_logits_restrict_init()
+    struct ggml_tensor  * ids    = nullptr;
+    struct ggml_context * ctx    = nullptr;
+    ggml_backend_buffer_t buffer = nullptr;
+
+    // work buffer for the restricted logits of a single token
+    std::vector<float> buf;
+};
+
+// number of times an idle worker polls for new work before it goes to sleep
+#define WHISPER_THREAD_POOL_SPIN 64
+
+// persistent worker threads for the CPU work of a state that is split between threads for each generated token
+// (sampling, logits processing) and for the mel spectrogram
+// the threads are created on first use and sleep while there is no work
+struct whisper_thread_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    // the current task - protected by the mutex
+    const std::function<void(int)> * task = nullptr;
+
+    int  n_task = 0; // number of threads that run the task, including the caller
+    bool stop   = false;
+
+    std::atomic<uint64_t> generation { 0 };
+    std::atomic<int>      n_pending  { 0 };
+
+    ~whisper_thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            generation++;
+        }
+        cv_start.notify_all();
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    // run fn(ith) for ith = [0, n_threads) - ith == 0 runs on the calling thread
+    void run(int n_threads, const std::function<void(int)> & fn) {
+        if (n_threads <= 1) {
+            fn(0);
+            return;
+        }
+
+        while ((int) workers.size() < n_threads - 1) {
+            const int iw = workers.size();
+            workers.emplace_back([this, iw]() { worker(iw + 1); });
+        }
+
+        n_pending = n_threads - 1;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task   = &fn;
+            n_task = n_threads;
+            generation++;
+        }
+        cv_start.notify_all();
+
+        fn(0);
+
+        for (int i = 0; i < WHISPER_THREAD_POOL_SPIN && n_pending.load() > 0; ++i) {
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_pending.load() == 0; });
+
+        task = nullptr;
+    }
+
+private:
+    void worker(int ith) {
+        uint64_t seen = 0;
+
+        while (true) {
+            for (int i = 0; i < WHISPER_THREAD_POOL_SPIN && generation.load() == seen; ++i) {
+                std::this_thread::yield();
+            }
+
+            const std::function<void(int)> * fn = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_start.wait(lock, [&] { return generation.load() != seen; });
+
+                if (stop) {
+                    return;
+                }
+
+                seen = generation.load();
+
+                if (ith < n_task) {
+                    fn = task;
+                }
+            }
+
+            if (fn) {
+                (*fn)(ith);
+
+                if (--n_pending == 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -883,6 +1194,12 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_fail_r = 0; // number of early repetition-loop failures
+
+    // [EXPERIMENTAL] speculative decoding
+    int64_t t_draft_us     = 0;
+    int32_t n_draft        = 0; // number of proposed draft tokens
+    int32_t n_draft_accept = 0; // number of draft tokens accepted by the main model
 
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
@@ -898,6 +1215,20 @@ struct whisper_state {
     whisper_kv_cache kv_pad;
 
     whisper_mel mel;
+    whisper_mel_source mel_src;
+
+    whisper_thread_pool pool;
+
+    whisper_logits_suppress logits_suppress;
+    whisper_logits_reduce   logits_reduce;
+    whisper_logits_restrict logits_restrict;
+
+    // [EXPERIMENTAL] speculative decoding - the state of the draft model, created by the first whisper_full() call
+    // that uses it, and the tokens in its KV cache
+    whisper_context * draft_ctx   = nullptr;
+    whisper_state   * draft_state = nullptr;
+
+    std::vector<whisper_token> draft_past;
 
     whisper_batch batch;
 
@@ -911,6 +1242,19 @@ struct whisper_state {
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    // [EXPERIMENTAL] batched encoder - created by the first state of a whisper_encode_batch() call
+    whisper_sched sched_encode_batch;
+    int32_t       sched_encode_batch_n = 0; // max number of windows the scheduler has been created for
+
+    // [EXPERIMENTAL] batched encoder in whisper_full() - the windows encoded ahead of the current one
+    // the cross-attention memory of a window is swapped into kv_cross when the transcription reaches it
+    std::vector<whisper_kv_cache> kv_cross_ahead;
+    std::vector<whisper_kv_cache> kv_pad_ahead;
+    std::vector<int>              seek_ahead; // the window of each cache, -1 if none
+
+    // [EXPERIMENTAL] continuous batching - merge the decoder steps with other states
+    whisper_batch_sched * batch_sched = nullptr;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
@@ -944,6 +1288,7 @@ struct whisper_state {
     whisper_token tid_last;
 
     std::vector<float> energy; // PCM signal energy
+    int energy_offset = 0;     // energy holds the samples [energy_offset, energy_offset + energy.size())
     float no_speech_prob = 0.0f;
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -968,6 +1313,11 @@ struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
+    // load phases: hparams, vocab and tensor headers / tensor allocation / tensor data
+    int64_t t_load_meta_us  = 0;
+    int64_t t_load_alloc_us = 0;
+    int64_t t_load_data_us  = 0;
+
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
 
@@ -1016,9 +1366,19 @@ static bool whisper_kv_cache_init(
     cache.head = 0;
     cache.size = n_ctx;
 
+    cache.n_state = n_text_state;
+    cache.n_layer = n_text_layer;
+
     cache.cells.clear();
     cache.cells.resize(n_ctx);
 
+    cache.used  = 0;
+    cache.n_max = 0;
+
+    cache.seq_mask.assign(WHISPER_MAX_SEQ*n_ctx, -INFINITY);
+
+    std::fill(cache.seq_pos_max, cache.seq_pos_max + WHISPER_MAX_SEQ, -1);
+
     struct ggml_context * ctx = ggml_init(params);
 
     if (!ctx) {
@@ -1042,13 +1402,125 @@ static bool whisper_kv_cache_init(
     return true;
 }
 
+// number of self-attention KV cells needed by n_decoders decoders that share the prompt
+// the prompt and the tokens of one decoder take at most n_text_ctx cells, and each of the other decoders adds at most
+// n_text_ctx/2 tokens of its own - the beam search shares the common prefix of the beams (whisper_kv_cache_seq_remap)
+static int whisper_kv_self_n_ctx(const whisper_context & wctx, int n_decoders) {
+    const int n_text_ctx = wctx.model.hparams.n_text_ctx;
+
+    return GGML_PAD(n_text_ctx + (n_decoders - 1)*(n_text_ctx/2), 256);
+}
+
 static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
     ggml_backend_buffer_free(cache.buffer);
 }
 
+// set the position and the sequences of cell i
+static void whisper_kv_cache_cell_set(
+        struct whisper_kv_cache & cache,
+                       uint32_t   i,
+                    whisper_pos   pos,
+               whisper_seq_mask   seq) {
+    auto & cell = cache.cells[i];
+
+    // update the KQ mask rows of the sequences that have been added or removed
+    for (whisper_seq_mask diff = cell.seq ^ seq, s = 0; diff != 0; diff >>= 1, ++s) {
+        if (diff & 1) {
+            cache.seq_mask[s*cache.size + i] = (seq >> s) & 1 ? 0.0f : -INFINITY;
+        }
+    }
+
+    if (cell.seq == 0 && seq != 0) {
+        cache.used++;
+        cache.n_max = std::max(cache.n_max, i + 1);
+    } else if (cell.seq != 0 && seq == 0) {
+        cache.used--;
+        cell.seq = 0;
+        while (cache.n_max > 0 && cache.cells[cache.n_max - 1].seq == 0) {
+            cache.n_max--;
+        }
+    }
+
+    cell.pos = seq != 0 ? pos : -1;
+    cell.seq = seq;
+}
+
+// move the used cells to the front of the cache, keeping their order, so that all free cells are contiguous
+// the beam search frees the cells of the discarded beams, which leaves holes that are too small for a batch
+// v_trans: V is stored transposed ([n_layer][n_state][size]), as done by the decoder without flash attention
+static void whisper_kv_cache_defrag(struct whisper_kv_cache & cache, bool v_trans) {
+    if (cache.used == cache.n_max) {
+        return;
+    }
+
+    std::vector<whisper_kv_cell> cells;
+    std::vector<uint32_t>        ids;
+
+    cells.reserve(cache.used);
+    ids  .reserve(cache.used);
+
+    for (uint32_t i = 0; i < cache.n_max; ++i) {
+        if (cache.cells[i].seq != 0) {
+            cells.push_back(cache.cells[i]);
+            ids  .push_back(i);
+        }
+    }
+
+    const uint32_t n_used = cells.size();
+
+    // the cells only move to lower indices, so the data can be moved in place in ascending order
+    std::vector<uint8_t> buf;
+
+    for (auto * t : { cache.k, cache.v }) {
+        const size_t es = ggml_element_size(t);
+
+        buf.resize(ggml_nbytes(t));
+        ggml_backend_tensor_get(t, buf.data(), 0, buf.size());
+
+        if (t == cache.v && v_trans) {
+            for (int64_t il = 0; il < cache.n_layer; ++il) {
+                for (int64_t is = 0; is < cache.n_state; ++is) {
+                    uint8_t * row = buf.data() + ((il*cache.n_state + is)*cache.size)*es;
+
+                    for (uint32_t d = 0; d < n_used; ++d) {
+                        if (d != ids[d]) {
+                            memcpy(row + d*es, row + ids[d]*es, es);
+                        }
+                    }
+                }
+            }
+        } else {
+            const size_t nb = cache.n_state*es;
+
+            for (int64_t il = 0; il < cache.n_layer; ++il) {
+                uint8_t * data = buf.data() + il*cache.size*nb;
+
+                for (uint32_t d = 0; d < n_used; ++d) {
+                    if (d != ids[d]) {
+                        memcpy(data + d*nb, data + ids[d]*nb, nb);
+                    }
+                }
+            }
+        }
+
+        ggml_backend_tensor_set(t, buf.data(), 0, buf.size());
+    }
+
+    for (uint32_t i = 0, n = cache.n_max; i < n; ++i) {
+        whisper_kv_cache_cell_set(cache, i, -1, 0);
+    }
+
+    for (uint32_t d = 0; d < n_used; ++d) {
+        whisper_kv_cache_cell_set(cache, d, cells[d].pos, cells[d].seq);
+    }
+
+    cache.head = n_used;
+}
+
 static bool whisper_kv_cache_find_slot(
            struct whisper_kv_cache & cache,
-        const struct whisper_batch & batch) {
+        const struct whisper_batch & batch,
+                              bool   v_trans) {
     const uint32_t n_ctx    = cache.size;
     const uint32_t n_tokens = batch.n_tokens;
 
@@ -1057,6 +1529,10 @@ static bool whisper_kv_cache_find_slot(
         return false;
     }
 
+    if (cache.used + n_tokens > n_ctx) {
+        return false;
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -1066,9 +1542,14 @@ static bool whisper_kv_cache_find_slot(
             continue;
         }
 
+        // the cells past the last used one are free
+        if (cache.head >= cache.n_max) {
+            break;
+        }
+
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
+            if (cache.cells[cache.head + i].seq != 0) {
                 found = false;
                 cache.head += i + 1;
                 n_tested   += i + 1;
@@ -1081,17 +1562,31 @@ static bool whisper_kv_cache_find_slot(
         }
 
         if (n_tested >= n_ctx) {
-            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
+            // there are enough free cells, but not in one piece
+            WHISPER_LOG_DEBUG("%s: defragmenting the KV cache for %d tokens (%d / %d cells used)\n", __func__, n_tokens, cache.used, n_ctx);
+
+            whisper_kv_cache_defrag(cache, v_trans);
+            break;
         }
     }
 
+    cache.causal = true;
+
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        const whisper_pos pos = batch.pos[i];
+
+        whisper_seq_mask seq = 0;
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            const whisper_seq_id seq_id = batch.seq_id[i][j];
+
+            seq |= whisper_seq_mask(1) << seq_id;
+
+            cache.causal = cache.causal && pos > cache.seq_pos_max[seq_id];
+            cache.seq_pos_max[seq_id] = std::max(cache.seq_pos_max[seq_id], pos);
         }
+
+        whisper_kv_cache_cell_set(cache, cache.head + i, pos, seq);
     }
 
     return true;
@@ -1099,21 +1594,27 @@ static bool whisper_kv_cache_find_slot(
 
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
-        }
-    }
-
-    return 1;
+    return std::max(1u, cache.n_max);
 }
 
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+    for (uint32_t i = 0; i < cache.n_max; ++i) {
+        auto & cell = cache.cells[i];
+
+        for (whisper_seq_mask seq = cell.seq, s = 0; seq != 0; seq >>= 1, ++s) {
+            if (seq & 1) {
+                cache.seq_mask[s*cache.size + i] = -INFINITY;
+            }
+        }
+
+        cell.pos = -1;
+        cell.seq = 0;
     }
-    cache.head = 0;
+    cache.head  = 0;
+    cache.used  = 0;
+    cache.n_max = 0;
+
+    std::fill(cache.seq_pos_max, cache.seq_pos_max + WHISPER_MAX_SEQ, -1);
 
     ggml_backend_buffer_clear(cache.buffer, 0);
 }
@@ -1128,18 +1629,25 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
+    const whisper_seq_mask seq_rm = seq_id < 0 ? ~whisper_seq_mask(0) : whisper_seq_mask(1) << seq_id;
+
+    for (uint32_t i = 0, n = cache.n_max; i < n; ++i) {
+        const auto & cell = cache.cells[i];
+
+        if ((cell.seq & seq_rm) != 0 && cell.pos >= p0 && cell.pos < p1) {
+            whisper_kv_cache_cell_set(cache, i, cell.pos, cell.seq & ~seq_rm);
+
+            if (cell.seq == 0 && new_head == cache.size) {
+                new_head = i;
             }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
-                if (new_head == cache.size) new_head = i;
+        }
+    }
+
+    // the positions past p0 are removed only if the range is open
+    if (p1 == std::numeric_limits<whisper_pos>::max()) {
+        for (int s = 0; s < WHISPER_MAX_SEQ; ++s) {
+            if ((seq_rm >> s) & 1) {
+                cache.seq_pos_max[s] = std::min(cache.seq_pos_max[s], p0 - 1);
             }
         }
     }
@@ -1159,60 +1667,170 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+    for (uint32_t i = 0; i < cache.n_max; ++i) {
+        const auto & cell = cache.cells[i];
+
+        if (cell.has_seq_id(seq_id_src) && cell.pos >= p0 && cell.pos < p1) {
+            whisper_kv_cache_cell_set(cache, i, cell.pos, cell.seq | (whisper_seq_mask(1) << seq_id_dst));
         }
     }
+
+    cache.seq_pos_max[seq_id_dst] = std::max(cache.seq_pos_max[seq_id_dst], std::min(cache.seq_pos_max[seq_id_src], p1 - 1));
 }
 
-static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
-    if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
-        return 1u;
-    }
+// remove all sequences except seq_id from the cache
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    const whisper_seq_mask seq_keep = whisper_seq_mask(1) << seq_id;
 
-#ifdef GGML_USE_METAL
-    if (wctx.params.use_gpu) {
-        return 32u;
+    for (uint32_t i = 0, n = cache.n_max; i < n; ++i) {
+        const auto & cell = cache.cells[i];
+
+        whisper_kv_cache_cell_set(cache, i, cell.pos, cell.seq & seq_keep);
     }
-#endif
 
-#ifdef GGML_USE_CUDA
-    if (wctx.params.use_gpu) {
-        return 256u;
+    for (int s = 0; s < WHISPER_MAX_SEQ; ++s) {
+        if (s != seq_id) {
+            cache.seq_pos_max[s] = -1;
+        }
     }
-#endif
 
-    return 1u;
+    cache.head = 0;
 }
 
-// [EXPERIMENTAL] Token-level timestamps with DTW
-static bool aheads_masks_init(
-        const whisper_context_params & cparams,
-               const whisper_hparams & hparams,
-         struct whisper_aheads_masks & aheads_masks,
-                      ggml_backend_t   backend) {
+// reorder the sequences after a beam search step - sequence j continues sequence src[j] for j < n_seq
+// the sequences share the cells of their common prefix and the new tokens are written to new cells, so the K/V data
+// is never copied. the cells that no sequence refers to anymore are freed
+static void whisper_kv_cache_seq_remap(
+        struct whisper_kv_cache & cache,
+          const whisper_seq_id  * src,
+                            int   n_seq) {
+    whisper_pos seq_pos_max[WHISPER_MAX_SEQ];
+    std::copy(cache.seq_pos_max, cache.seq_pos_max + WHISPER_MAX_SEQ, seq_pos_max);
 
-    const int32_t n_text_layer = hparams.n_text_layer;
-    const int32_t n_head = hparams.n_text_head;
+    for (uint32_t i = 0, n = cache.n_max; i < n; ++i) {
+        const auto & cell = cache.cells[i];
 
-    // Sanity checks
-    if (cparams.dtw_aheads_preset == WHISPER_AHEADS_NONE) {
-        WHISPER_LOG_ERROR("%s: dtw_aheads_preset should be != DTW_AHEADS_NONE\n", __func__);
-        return false;
-    } else if (cparams.dtw_aheads_preset == WHISPER_AHEADS_N_TOP_MOST) {
-        if (cparams.dtw_n_top > n_text_layer || cparams.dtw_n_top <= 0) {
-            WHISPER_LOG_ERROR("%s: dtw_n_top must be between %d and %d for this model.", __func__, 1, n_text_layer);
-            return false;
+        whisper_seq_mask seq = cell.seq & ~((whisper_seq_mask(1) << n_seq) - 1);
+
+        for (int j = 0; j < n_seq; ++j) {
+            seq |= whisper_seq_mask(cell.has_seq_id(src[j])) << j;
         }
-    } else {
-        const auto aheads = cparams.dtw_aheads_preset == WHISPER_AHEADS_CUSTOM ? cparams.dtw_aheads : g_aheads.at(cparams.dtw_aheads_preset);
-        if (cparams.dtw_aheads_preset == WHISPER_AHEADS_CUSTOM) {
-            if (aheads.n_heads == 0) {
-                WHISPER_LOG_ERROR("%s: dtw_aheads.n_heads should be > 0", __func__);
-                return false;
-            }
-            if (aheads.heads == NULL) {
+
+        if (seq != cell.seq) {
+            whisper_kv_cache_cell_set(cache, i, cell.pos, seq);
+        }
+    }
+
+    for (int j = 0; j < n_seq; ++j) {
+        cache.seq_pos_max[j] = seq_pos_max[src[j]];
+    }
+
+    cache.head = 0;
+}
+
+// build the self-attention KQ mask for the current batch
+// data must hold n_kv*GGML_PAD(n_tokens, GGML_KQ_MASK_PAD) elements
+//
+// if the tokens of the batch are past all cells of their sequences (the usual case), the rows are copies of the
+// per-sequence rows of the cache, in which only the cells of the batch itself have to be masked causally
+static void whisper_kv_cache_build_mask(
+    const struct whisper_kv_cache & kv_self,
+      const struct whisper_batch  & batch,
+                          float   * data) {
+    const int32_t n_kv     = kv_self.n;
+    const int32_t n_tokens = batch.n_tokens;
+
+    for (int h = 0; h < 1; ++h) {
+        if (kv_self.causal) {
+            const int32_t i0 = kv_self.head;
+            const int32_t i1 = kv_self.head + n_tokens;
+
+            for (int j = 0; j < n_tokens; ++j) {
+                const whisper_pos    pos    = batch.pos[j];
+                const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+                float * row = data + h*(n_kv*n_tokens) + j*n_kv;
+
+                memcpy(row, kv_self.seq_mask.data() + seq_id*kv_self.size, n_kv*sizeof(float));
+
+                for (int i = i0; i < i1; ++i) {
+                    if (kv_self.cells[i].pos > pos) {
+                        row[i] = -INFINITY;
+                    }
+                }
+            }
+        } else {
+            memset(data, 0, n_kv*n_tokens*sizeof(float));
+
+            for (int j = 0; j < n_tokens; ++j) {
+                const whisper_pos    pos    = batch.pos[j];
+                const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+                for (int i = 0; i < n_kv; ++i) {
+                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                    }
+                }
+            }
+        }
+
+        for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
+            for (int j = 0; j < n_kv; ++j) {
+                data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
+            }
+        }
+    }
+}
+
+static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
+    if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
+        return 1u;
+    }
+
+#ifdef GGML_USE_METAL
+    if (wctx.params.use_gpu) {
+        return 32u;
+    }
+#endif
+
+#ifdef GGML_USE_CUDA
+    if (wctx.params.use_gpu) {
+        return 256u;
+    }
+#endif
+
+    return 1u;
+}
+
+// [EXPERIMENTAL] Token-level timestamps with DTW
+static bool aheads_masks_init(
+        const whisper_context_params & cparams,
+               const whisper_hparams & hparams,
+         struct whisper_aheads_masks & aheads_masks,
+                      ggml_backend_t   backend) {
+
+    const int32_t n_text_layer = hparams.n_text_layer;
+    const int32_t n_head = hparams.n_text_head;
+
+    // Sanity checks
+    if (cparams.dtw_aheads_preset == WHISPER_AHEADS_NONE) {
+        WHISPER_LOG_ERROR("%s: dtw_aheads_preset should be != DTW_AHEADS_NONE\n", __func__);
+        return false;
+    } else if (cparams.dtw_aheads_preset == WHISPER_AHEADS_N_TOP_MOST) {
+        if (cparams.dtw_n_top > n_text_layer || cparams.dtw_n_top <= 0) {
+            WHISPER_LOG_ERROR("%s: dtw_n_top must be between %d and %d for this model.", __func__, 1, n_text_layer);
+            return false;
+        }
+    } else {
+        const auto aheads = cparams.dtw_aheads_preset == WHISPER_AHEADS_CUSTOM ? cparams.dtw_aheads : g_aheads.at(cparams.dtw_aheads_preset);
+        if (cparams.dtw_aheads_preset == WHISPER_AHEADS_CUSTOM) {
+            if (aheads.n_heads == 0) {
+                WHISPER_LOG_ERROR("%s: dtw_aheads.n_heads should be > 0", __func__);
+                return false;
+            }
+            if (aheads.heads == NULL) {
                 WHISPER_LOG_ERROR("%s: dtw_aheads.heads unset", __func__);
                 return false;
             }
@@ -1491,6 +2109,178 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
+// header of a tensor in the model file
+struct whisper_tensor_header {
+    std::string name;
+
+    int32_t n_dims = 0;
+    int32_t ne[4]  = { 1, 1, 1, 1 };
+    int32_t ttype  = 0;
+
+    size_t offs   = 0; // offset of the tensor data in the file
+    size_t nbytes = 0;
+};
+
+// walk the tensor headers of the mapped model file, starting at the current read position
+// returns false if the headers do not describe the rest of the file exactly
+static bool whisper_mmap_scan_tensors(const whisper_mmap & mapping, std::vector<whisper_tensor_header> & headers) {
+    const char * data = (const char *) mapping.addr;
+
+    size_t pos = mapping.pos;
+
+    auto read_i32 = [&](int32_t & dst) {
+        if (pos + sizeof(int32_t) > mapping.size) {
+            return false;
+        }
+        memcpy(&dst, data + pos, sizeof(int32_t));
+        pos += sizeof(int32_t);
+        return true;
+    };
+
+    while (pos < mapping.size) {
+        whisper_tensor_header hdr;
+
+        int32_t length;
+
+        if (!read_i32(hdr.n_dims) || !read_i32(length) || !read_i32(hdr.ttype)) {
+            return false;
+        }
+
+        if (hdr.n_dims < 1 || hdr.n_dims > 4 || length < 0 || hdr.ttype < 0 || hdr.ttype >= GGML_TYPE_COUNT || ggml_type_size(ggml_type(hdr.ttype)) == 0) {
+            return false;
+        }
+
+        for (int i = 0; i < hdr.n_dims; ++i) {
+            if (!read_i32(hdr.ne[i]) || hdr.ne[i] <= 0) {
+                return false;
+            }
+        }
+
+        if (pos + length > mapping.size) {
+            return false;
+        }
+
+        hdr.name.assign(data + pos, length);
+        pos += length;
+
+        hdr.offs   = pos;
+        hdr.nbytes = ggml_row_size(ggml_type(hdr.ttype), hdr.ne[0])*hdr.ne[1]*hdr.ne[2]*hdr.ne[3];
+
+        if (pos + hdr.nbytes > mapping.size) {
+            return false;
+        }
+
+        pos += hdr.nbytes;
+
+        headers.push_back(std::move(hdr));
+    }
+
+    return true;
+}
+
+// alignment of the tensor data in the file that is required to use it in-place
+// the model files do not pad the tensor data, so on architectures with cheap unaligned access any offset is accepted
+static size_t whisper_mmap_alignment(ggml_type type) {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86) || defined(__aarch64__) || defined(_M_ARM64)
+    GGML_UNUSED(type);
+    return 1;
+#else
+    // the quantized blocks contain only fp16 and 8-bit values
+    return ggml_type_size(type) % 4 == 0 ? 4 : 2;
+#endif
+}
+
+#define WHISPER_LOAD_N_THREADS_MAX 8
+#define WHISPER_LOAD_CHUNK_SIZE    (16*1024*1024)
+
+// a piece of the tensor data to load from the mapped model file
+struct whisper_load_item {
+    ggml_tensor * tensor;
+
+    size_t offs_file;   // offset in the file
+    size_t offs_tensor; // offset in the tensor
+    size_t size;
+
+    bool upload; // copy to device memory through a staging buffer
+};
+
+// load the tensor data from the mapped model file using multiple threads
+// the items are processed in file order, so the threads read ahead of each other through the file:
+//   - tensors that point into the mapping are only paged in
+//   - tensors in CPU memory are copied straight from the mapping
+//   - device uploads are first copied into a per-thread staging buffer, so reading the next chunk from the file
+//     overlaps with the upload of the previous one - the uploads themselves are serialized
+static void whisper_mmap_load_tensors(const whisper_mmap & mapping, const std::vector<whisper_load_item> & items, int n_threads) {
+    const char * data = (const char *) mapping.addr;
+
+    std::atomic<size_t> i_next(0);
+    std::mutex mutex_upload;
+
+    auto worker = [&]() {
+        std::vector<uint8_t> staging;
+
+        uint8_t sum = 0;
+
+        for (size_t i = i_next++; i < items.size(); i = i_next++) {
+            const auto & item = items[i];
+
+            const char * src = data + item.offs_file;
+
+            if (item.tensor->data == src) {
+                // in-place - touch the pages so that they are resident before the first inference
+                for (size_t j = 0; j < item.size; j += 4096) {
+                    sum += src[j];
+                }
+            } else if (item.upload) {
+                staging.resize(item.size);
+                memcpy(staging.data(), src, item.size);
+
+                std::lock_guard<std::mutex> lock(mutex_upload);
+                ggml_backend_tensor_set(item.tensor, staging.data(), item.offs_tensor, item.size);
+            } else {
+                ggml_backend_tensor_set(item.tensor, src, item.offs_tensor, item.size);
+            }
+        }
+
+        // keep the page touches from being optimized away
+        volatile uint8_t sink = sum;
+        GGML_UNUSED(sink);
+    };
+
+    n_threads = std::max(1, std::min<int>(n_threads, (int) items.size()));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// each mel filter is a triangle that covers only a few of the FFT bins
+// store the non-zero range of every filter, so that the filterbank can be applied as a sparse matrix
+static void whisper_filters_init_spans(whisper_filters & filters) {
+    filters.span_begin.resize(filters.n_mel);
+    filters.span_end  .resize(filters.n_mel);
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const float * filter = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+
+        while (k0 < k1 && filter[k0]     == 0.0f) k0++;
+        while (k1 > k0 && filter[k1 - 1] == 0.0f) k1--;
+
+        filters.span_begin[j] = k0;
+        filters.span_end  [j] = k1;
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1603,6 +2393,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_spans(filters);
     }
 
     // load vocab
@@ -1731,6 +2523,44 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     // Create a list of available bufts, in priority order
     buft_list_t buft_list = make_buft_list(wctx.params);
 
+    // when the model file is mapped, the weights that end up in CPU memory are used in-place if their data is
+    // suitably aligned in the file - the rest of the weights are copied from the mapping
+    whisper_mmap * mapping = model.mapping.get();
+
+    std::vector<whisper_tensor_header> mapped_headers; // the tensor headers, read up front
+    std::map<std::string, size_t>      mapped_offs;    // offsets of the tensor data in the file
+    ggml_context * ctx_mapped = nullptr;               // tensors that point into the mapping
+
+    std::map<ggml_tensor *, size_t> mapped_tensors;
+
+    if (mapping) {
+        if (!whisper_mmap_scan_tensors(*mapping, mapped_headers)) {
+            WHISPER_LOG_ERROR("%s: failed to read the tensor headers from the model file\n", __func__);
+            return false;
+        }
+
+        for (const auto & hdr : mapped_headers) {
+            mapped_offs[hdr.name] = hdr.offs;
+        }
+
+        ggml_init_params params = {
+            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        ctx_mapped = ggml_init(params);
+        if (!ctx_mapped) {
+            throw std::runtime_error("failed to create ggml context");
+        }
+
+        model.ctxs.emplace_back(ctx_mapped);
+    }
+
+    const int64_t t_start_alloc_us = ggml_time_us();
+
+    wctx.t_load_meta_us = t_start_alloc_us - t_start_us;
+
     auto create_tensor = [&](asr_tensor type, asr_system system, ggml_tensor * meta, int layer = 0) -> ggml_tensor * {
         ggml_op op = ASR_TENSOR_INFO.at(type);
         ggml_backend_buffer_type_t buft = select_weight_buft(hparams, meta, op, buft_list);
@@ -1738,10 +2568,23 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", ASR_TENSOR_NAMES.at(system).at(type)));
         }
 
-        ggml_context * ctx = get_ctx(buft);
-        ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
+        const std::string name = format(ASR_TENSOR_NAMES.at(system).at(type), layer);
 
-        model.tensors[format(ASR_TENSOR_NAMES.at(system).at(type), layer)] = tensor;
+        ggml_tensor * tensor = nullptr;
+
+        if (ctx_mapped && buft == ggml_backend_cpu_buffer_type()) {
+            const auto it = mapped_offs.find(name);
+            if (it != mapped_offs.end() && it->second % whisper_mmap_alignment(meta->type) == 0) {
+                tensor = ggml_dup_tensor(ctx_mapped, meta);
+                mapped_tensors[tensor] = it->second;
+            }
+        }
+
+        if (!tensor) {
+            tensor = ggml_dup_tensor(get_ctx(buft), meta);
+        }
+
+        model.tensors[name] = tensor;
 
         return tensor;
     };
@@ -1878,57 +2721,61 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    // load weights
-    {
-        size_t total_size = 0;
+    // the mapped tensors share a single buffer that wraps the whole mapping
+    ggml_backend_buffer_t buf_mapped = nullptr;
 
-        model.n_loaded = 0;
+    if (!mapped_tensors.empty()) {
+        buf_mapped = ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size);
+        if (!buf_mapped) {
+            throw std::runtime_error("failed to create a buffer for the mapped model file");
+        }
 
-        std::vector<char> read_buf;
+        model.buffers.emplace_back(buf_mapped);
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+        size_t size_mapped = 0;
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+        for (const auto & it : mapped_tensors) {
+            ggml_backend_tensor_alloc(buf_mapped, it.first, (char *) mapping->addr + it.second);
+            size_mapped += ggml_nbytes(it.first);
+        }
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+        WHISPER_LOG_INFO("%s: %12s mapped size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf_mapped), size_mapped / 1e6);
+    }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+    const int64_t t_start_data_us = ggml_time_us();
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+    wctx.t_load_alloc_us = t_start_data_us - t_start_alloc_us;
 
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        auto check_tensor = [&](const std::string & name, int32_t n_dims, const int32_t * ne, int32_t ttype) -> ggml_tensor * {
             if (model.tensors.find(name) == model.tensors.end()) {
                 WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
+                return nullptr;
             }
 
             auto tensor = model.tensors[name.data()];
 
+            int32_t nelements = 1;
+            for (int i = 0; i < n_dims; ++i) {
+                nelements *= ne[i];
+            }
+
             if (ggml_nelements(tensor) != nelements) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
                 WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
                         __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return false;
+                return nullptr;
             }
 
             if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
                         __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return false;
+                return nullptr;
             }
 
             const size_t bpe = ggml_type_size(ggml_type(ttype));
@@ -1936,41 +2783,112 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
                         __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
+                return nullptr;
             }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+            return tensor;
+        };
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+        if (mapping) {
+            // all headers are known, so the data can be loaded in parallel
+            std::vector<whisper_load_item> items;
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
-            }
+            for (const auto & hdr : mapped_headers) {
+                auto tensor = check_tensor(hdr.name, hdr.n_dims, hdr.ne, hdr.ttype);
+                if (!tensor) {
+                    return false;
+                }
 
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
-        }
+                const size_t nbytes = ggml_nbytes(tensor);
 
-        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+                ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(tensor->buffer));
 
-        if (model.n_loaded == 0) {
-            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
-        } else if (model.n_loaded != (int) model.tensors.size()) {
-            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
-            return false;
-        }
-    }
+                if (dev && ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU && !ggml_backend_buffer_is_host(tensor->buffer)) {
+                    // device memory - upload in chunks to bound the size of the staging buffers
+                    for (size_t offs = 0; offs < nbytes; offs += WHISPER_LOAD_CHUNK_SIZE) {
+                        items.push_back({ tensor, hdr.offs + offs, offs, std::min<size_t>(WHISPER_LOAD_CHUNK_SIZE, nbytes - offs), true });
+                    }
+                } else {
+                    // CPU memory - the extra buffer types (e.g. repacked weights) require the whole tensor at once
+                    items.push_back({ tensor, hdr.offs, 0, nbytes, false });
+                }
 
-    for (auto & buf : model.buffers) {
-        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
-    }
+                total_size += nbytes;
+                model.n_loaded++;
+            }
+
+            const int n_threads = std::min<int>(WHISPER_LOAD_N_THREADS_MAX, std::max(1, (int) std::thread::hardware_concurrency()));
+
+            whisper_mmap_load_tensors(*mapping, items, n_threads);
+
+            mapping->pos = mapping->size;
+        } else {
+            std::vector<char> read_buf;
+
+            while (true) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
+
+                read_safe(loader, n_dims);
+                read_safe(loader, length);
+                read_safe(loader, ttype);
+
+                if (loader->eof(loader->context)) {
+                    break;
+                }
+
+                int32_t ne[4] = { 1, 1, 1, 1 };
+                for (int i = 0; i < n_dims; ++i) {
+                    read_safe(loader, ne[i]);
+                }
+
+                std::string name;
+                std::vector<char> tmp(length); // create a buffer
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                name.assign(&tmp[0], tmp.size());
+
+                auto tensor = check_tensor(name, n_dims, ne, ttype);
+                if (!tensor) {
+                    return false;
+                }
+
+                if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                    // for the CPU and Metal backend, we can read directly into the tensor
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                    BYTESWAP_TENSOR(tensor);
+                } else {
+                    // read into a temporary buffer first, then copy to device memory
+                    read_buf.resize(ggml_nbytes(tensor));
+
+                    loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                    ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                }
+
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+            }
+        }
+
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return false;
+        }
+    }
+
+    for (auto & buf : model.buffers) {
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    }
+
+    const int64_t t_end_us = ggml_time_us();
 
-    wctx.t_load_us = ggml_time_us() - t_start_us;
+    wctx.t_load_data_us = t_end_us - t_start_data_us;
+    wctx.t_load_us      = t_end_us - t_start_us;
 
     return true;
 }
@@ -1993,99 +2911,85 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
-static struct ggml_cgraph * whisper_build_graph_conv(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
-
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
-
-    const int n_mels = hparams.n_mels;
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+// a window evaluated by the encoder graph
+//
+// with the batched encoder, several windows are stacked along the batch dimension - they can belong to different
+// states or be several windows of the same audio, with the output stored in separate KV caches
+struct whisper_encode_window {
+    whisper_state * wstate = nullptr; // the mel spectrogram and the timings
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    ggml_set_name(mel, "mel");
-    ggml_set_input(mel);
+    int mel_offset = 0;
 
-    struct ggml_tensor * cur = nullptr;
+    whisper_kv_cache * kv_cross = nullptr; // the cross-attention memory of the window
+    whisper_kv_cache * kv_pad   = nullptr; // padded buffer for flash-attention
+};
 
-    if (!whisper_encode_external(wstate)) {
-        // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+// same as ggml_conv_1d_ph() but with support for a batch of inputs b: [N, IC, IL] -> [N, OC, OL]
+static struct ggml_tensor * whisper_conv_1d_ph_batch(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+                        int   s0) {
+    if (b->ne[2] == 1) {
+        return ggml_conv_1d_ph(ctx, a, b, s0, 1);
+    }
 
-            cur = ggml_gelu(ctx0, cur);
+    struct ggml_tensor * im2col = ggml_im2col(ctx, a, b, s0, 0, a->ne[0]/2, 0, 1, 0, false, GGML_TYPE_F16); // [N, OL, IC * K]
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+    struct ggml_tensor * result =
+        ggml_mul_mat(ctx,
+                ggml_reshape_2d(ctx, im2col, im2col->ne[0], (im2col->ne[2] * im2col->ne[1])), // [N, OL, IC * K] => [N*OL, IC * K]
+                ggml_reshape_2d(ctx, a, (a->ne[0] * a->ne[1]), a->ne[2]));                    // [OC, IC, K] => [OC, IC * K]
 
-            cur = ggml_gelu(ctx0, cur);
-        }
+    // [OC, N*OL] => [N, OC, OL]
+    result = ggml_reshape_3d(ctx, result, im2col->ne[1], im2col->ne[2], a->ne[2]);
+    result = ggml_cont(ctx, ggml_permute(ctx, result, 0, 2, 1, 3));
 
-        ggml_set_name(cur, "embd_conv");
-        wstate.embd_conv = cur;
-    } else {
-        ggml_build_forward_expand(gf, mel);
+    return result;
+}
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_set_input(cur); // the external encoder will write into this tensor
+// convolution + gelu of the mel windows: [2*n_ctx, n_mels, n_batch] -> [n_ctx, n_state, n_batch]
+static struct ggml_tensor * whisper_build_conv(
+        struct ggml_context * ctx0,
+      const whisper_model & model,
+        struct ggml_tensor  * mel) {
+    struct ggml_tensor * cur = nullptr;
 
-        ggml_set_name(cur, "embd_enc");
-        wstate.embd_enc = cur;
-    }
+    cur = whisper_conv_1d_ph_batch(ctx0, model.e_conv_1_w, mel, 1);
+    cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
-    ggml_set_output(cur);
+    cur = ggml_gelu(ctx0, cur);
 
-    ggml_build_forward_expand(gf, cur);
+    cur = whisper_conv_1d_ph_batch(ctx0, model.e_conv_2_w, cur, 2);
+    cur = ggml_add(ctx0, cur, model.e_conv_2_b);
 
-    ggml_free(ctx0);
+    cur = ggml_gelu(ctx0, cur);
 
-    return gf;
+    return cur;
 }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
-        whisper_context & wctx,
-          whisper_state & wstate) {
+// the encoder layers over the given windows, stacked along the batch dimension:
+// [n_ctx, n_state, n_batch] -> [n_state, n_ctx*n_batch]
+static struct ggml_tensor * whisper_build_encoder(
+                         whisper_context & wctx,
+                     struct ggml_context * ctx0,
+                     struct ggml_cgraph  * gf,
+                     struct ggml_tensor  * cur,
+    const std::vector<whisper_encode_window> & windows) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_batch = windows.size();
+
+    const int n_ctx   = windows[0].wstate->exp_n_audio_ctx > 0 ? windows[0].wstate->exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
     const int n_state_head = n_state/n_head;
 
-    auto & kv_pad = wstate.kv_pad;
-
-    WHISPER_ASSERT(!!kv_pad.buffer);
-
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
-
     const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
     // ===================================================================
@@ -2106,7 +3010,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
     struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+    cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, cur)), e_pe);
+    cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
 
     // ===================================================================
 
@@ -2153,37 +3058,60 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             // ------
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
-                        0, 2, 1, 3);
-
             if (wctx.params.flash_attn) {
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
+                // the padded K and V of each window are stored in its own kv_pad
+                struct ggml_tensor * attn = nullptr;
 
-                struct ggml_tensor * K =
-                    ggml_view_3d(ctx0, kv_pad.k,
-                            n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.k)*n_state,
-                            ggml_element_size(kv_pad.k)*n_state_head,
-                            0);
+                for (int ib = 0; ib < n_batch; ++ib) {
+                    auto & kv_pad = *windows[ib].kv_pad;
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_pad.v,
-                            n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.v)*n_state,
-                            ggml_element_size(kv_pad.v)*n_state_head,
-                            0);
+                    WHISPER_ASSERT(!!kv_pad.buffer);
+
+                    struct ggml_tensor * Qcur_b = ggml_view_2d(ctx0, Qcur, n_state, n_ctx, Qcur->nb[1], ib*n_ctx*Qcur->nb[1]);
+                    struct ggml_tensor * Kcur_b = ggml_view_2d(ctx0, Kcur, n_state, n_ctx, Kcur->nb[1], ib*n_ctx*Kcur->nb[1]);
+                    struct ggml_tensor * Vcur_b = ggml_view_2d(ctx0, Vcur, n_state, n_ctx, Vcur->nb[1], ib*n_ctx*Vcur->nb[1]);
+
+                    struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0, Qcur_b, n_state_head, n_head, n_ctx),
+                                0, 2, 1, 3);
+
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur_b, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur_b, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
+
+                    struct ggml_tensor * K =
+                        ggml_view_3d(ctx0, kv_pad.k,
+                                n_state_head, n_ctx_pad, n_head,
+                                ggml_element_size(kv_pad.k)*n_state,
+                                ggml_element_size(kv_pad.k)*n_state_head,
+                                0);
+
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_pad.v,
+                                n_state_head, n_ctx_pad, n_head,
+                                ggml_element_size(kv_pad.v)*n_state,
+                                ggml_element_size(kv_pad.v)*n_state_head,
+                                0);
+
+                    struct ggml_tensor * cur_b = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
+                    cur_b = ggml_reshape_2d(ctx0, cur_b, n_state, n_ctx);
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
+                    attn = attn ? ggml_concat(ctx0, attn, cur_b, 1) : cur_b;
+                }
+
+                cur = attn;
             } else {
+                // the windows are independent batches of the attention
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_batch),
+                            0, 2, 1, 3);
+
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cast(ctx0,
-                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_batch),
                                 wctx.itype),
                             0, 2, 1, 3);
 
@@ -2195,9 +3123,9 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * V =
                     ggml_cast(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state_head, n_head, n_ctx),
+                                    n_state_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
                             wctx.itype);
 
@@ -2205,7 +3133,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx*n_batch);
             }
         }
 
@@ -2268,34 +3196,22 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
-    ggml_build_forward_expand(gf, cur);
-
-    wstate.embd_enc = cur;
-
-    //ggml_graph_print(gf);
-
-    ////////////////////////////////////////////////////////////////////////////
-
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-    //        ggml_used_mem(ctx0)/1e6,
-    //        wstate.get_buf_max_mem(0)/1e6,
-    //        wstate.get_buf_max_mem(1)/1e6,
-    //        wstate.get_buf_max_mem(2)/1e6,
-    //        wstate.get_buf_max_mem(3)/1e6);
-
-    ggml_free(ctx0);
-
-    return gf;
+    return cur;
 }
 
-// pre-compute cross-attention memory
-static struct ggml_cgraph * whisper_build_graph_cross(
-        whisper_context & wctx,
-          whisper_state & wstate) {
+// pre-compute the cross-attention memory of the given windows from the encoder output [n_state, n_ctx*n_batch]
+static void whisper_build_cross(
+                         whisper_context & wctx,
+                     struct ggml_context * ctx0,
+                     struct ggml_cgraph  * gf,
+                     struct ggml_tensor  * cur,
+    const std::vector<whisper_encode_window> & windows) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_batch = windows.size();
+
+    const int n_ctx   = windows[0].wstate->exp_n_audio_ctx > 0 ? windows[0].wstate->exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
 
@@ -2303,18 +3219,6 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
-
     const float  Kscale = pow(float(n_state_head), -0.25);
 
     for (int il = 0; il < model.hparams.n_text_layer; ++il) {
@@ -2334,110 +3238,240 @@ static struct ggml_cgraph * whisper_build_graph_cross(
                     Vcross,
                     layer.cross_attn_v_b);
 
-        struct ggml_tensor * k;
-        struct ggml_tensor * v;
+        for (int ib = 0; ib < n_batch; ++ib) {
+            auto & kv_cross = *windows[ib].kv_cross;
 
-        if (wctx.params.flash_attn) {
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
-
-            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
-        } else {
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            struct ggml_tensor * Kcross_b = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*n_ctx*Kcross->nb[1]);
+            struct ggml_tensor * Vcross_b = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]);
 
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
-            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-        }
+            if (wctx.params.flash_attn) {
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx_pad));
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
-    }
+                v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.v)*n_state)*(il*n_ctx_pad));
+            } else {
+                Vcross_b = ggml_transpose(ctx0, Vcross_b);
 
-    //ggml_graph_print(gf);
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
 
-    ggml_free(ctx0);
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
 
-    return gf;
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross_b, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross_b, v));
+        }
+    }
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
+static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads,
-    ggml_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
-
-    // conv
-    {
-        auto & sched = wstate.sched_conv.sched;
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+    const int n_mels = hparams.n_mels;
 
-        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-        // set the input
-        {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    struct ggml_context * ctx0 = ggml_init(params);
 
-            assert(mel->type == GGML_TYPE_F32);
-            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-            wstate.inp_mel.resize(ggml_nelements(mel));
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
+    struct ggml_tensor * cur = nullptr;
 
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    if (!whisper_encode_external(wstate)) {
+        // convolution + gelu
+        cur = whisper_build_conv(ctx0, model, mel);
 
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+        ggml_set_name(cur, "embd_conv");
+        wstate.embd_conv = cur;
+    } else {
+        ggml_build_forward_expand(gf, mel);
 
-            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
-        }
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_set_input(cur); // the external encoder will write into this tensor
 
-        if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-                return false;
-            }
-        } else {
-#if defined(WHISPER_USE_COREML)
-            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
-#elif defined(WHISPER_USE_OPENVINO)
-            whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
-#endif
-        }
+        ggml_set_name(cur, "embd_enc");
+        wstate.embd_enc = cur;
     }
 
-    // encoder
-    if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
+    ggml_set_output(cur);
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    auto & kv_pad = wstate.kv_pad;
+
+    WHISPER_ASSERT(!!kv_pad.buffer);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+
+    cur = whisper_build_encoder(wctx, ctx0, gf, cur, { { &wstate, 0, &wstate.kv_cross, &wstate.kv_pad } });
+
+    ggml_build_forward_expand(gf, cur);
+
+    wstate.embd_enc = cur;
+
+    //ggml_graph_print(gf);
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+    //        ggml_used_mem(ctx0)/1e6,
+    //        wstate.get_buf_max_mem(0)/1e6,
+    //        wstate.get_buf_max_mem(1)/1e6,
+    //        wstate.get_buf_max_mem(2)/1e6,
+    //        wstate.get_buf_max_mem(3)/1e6);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// pre-compute cross-attention memory
+static struct ggml_cgraph * whisper_build_graph_cross(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+
+    whisper_build_cross(wctx, ctx0, gf, cur, { { &wstate, 0, &wstate.kv_cross, &wstate.kv_pad } });
+
+    //ggml_graph_print(gf);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static bool whisper_mel_update_window(const whisper_context & wctx, whisper_state & wstate, int mel_offset, int n_ctx);
+
+// copy the window of 2*n_ctx mel frames starting at mel_offset into dst - frames past the end are zero
+static void whisper_mel_get_window(const whisper_mel & mel, int mel_offset, int n_ctx, float * dst) {
+    memset(dst, 0, mel.n_mel*2*n_ctx*sizeof(float));
+
+    const int i0 = std::max(std::min(mel_offset,           mel.n_len), mel.offset);
+    const int i1 = std::min(std::min(mel_offset + 2*n_ctx, mel.n_len), mel.offset + mel.n_frames);
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        for (int i = i0; i < i1; ++i) {
+            dst[j*2*n_ctx + (i - mel_offset)] = mel.data[j*mel.n_frames + (i - mel.offset)];
+        }
+    }
+}
+
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // conv
+    {
+        auto & sched = wstate.sched_conv.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        // set the input
+        {
+            const auto & mel_inp = wstate.mel;
+            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+            assert(mel->type == GGML_TYPE_F32);
+            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+
+            wstate.inp_mel.resize(ggml_nelements(mel));
+
+            if (!whisper_mel_update_window(wctx, wstate, mel_offset, n_ctx)) {
+                WHISPER_LOG_ERROR("%s: failed to compute the mel spectrogram\n", __func__);
+                return false;
+            }
+
+            whisper_mel_get_window(mel_inp, mel_offset, n_ctx, wstate.inp_mel.data());
+
+            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        }
+
+        if (!whisper_encode_external(wstate)) {
+            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+                return false;
+            }
+        } else {
+#if defined(WHISPER_USE_COREML)
+            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
+#elif defined(WHISPER_USE_OPENVINO)
+            whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
+#endif
+        }
+    }
+
+    // encoder
+    if (!whisper_encode_external(wstate)) {
+        auto & sched = wstate.sched_encode.sched;
 
         ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
@@ -2473,45 +3507,225 @@ static bool whisper_encode_internal(
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch,
-                    bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
+static size_t whisper_encode_batch_n_nodes(int n_batch) {
+    return WHISPER_MAX_NODES + 1024*n_batch;
+}
+
+// the conv, encoder and cross-attention memory of the given windows in a single graph
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+                         whisper_context & wctx,
+                           whisper_sched & wsched,
+    const std::vector<whisper_encode_window> & windows) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = wstate.kv_self;
+    const int n_batch = windows.size();
+
+    const int n_ctx  = windows[0].wstate->exp_n_audio_ctx > 0 ? windows[0].wstate->exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_mels = hparams.n_mels;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wsched.meta.size(),
+        /*.mem_buffer =*/ wsched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, whisper_encode_batch_n_nodes(n_batch), false);
+
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
+
+    struct ggml_tensor * cur = whisper_build_conv(ctx0, model, mel);
+
+    cur = whisper_build_encoder(wctx, ctx0, gf, cur, windows);
+
+    whisper_build_cross(wctx, ctx0, gf, cur, windows);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// [EXPERIMENTAL] batched encoder
+//
+// evaluates the encoder for several windows in a single graph
+// the windows are stacked along the batch dimension, so the matrix multiplications of the conv, encoder and
+// cross-attention projections run over all windows at once
+// the resulting cross-attention KV of each window is stored in its kv_cross
+// the compute buffer is kept in the state of the first window
+//
+static bool whisper_encode_batch_internal(
+                         whisper_context & wctx,
+    const std::vector<whisper_encode_window> & windows,
+                               const int   n_threads,
+                     ggml_abort_callback   abort_callback,
+                                  void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_batch = windows.size();
+
+    auto & wstate0 = *windows[0].wstate;
+
+    auto & wsched = wstate0.sched_encode_batch;
+
+    if (wsched.sched == nullptr || wstate0.sched_encode_batch_n < n_batch) {
+        const size_t n_nodes = whisper_encode_batch_n_nodes(n_batch);
+
+        ggml_backend_sched_free(wsched.sched);
+
+        wsched.sched = ggml_backend_sched_new(wstate0.backends.data(), nullptr, wstate0.backends.size(), n_nodes, false, true);
+        wsched.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+
+        wstate0.sched_encode_batch_n = n_batch;
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, wsched, windows);
+
+    if (!ggml_backend_sched_alloc_graph(wsched.sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    // set the input
+    {
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        const int n_ctx    = wstate0.exp_n_audio_ctx > 0 ? wstate0.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+        const int n_window = mel->ne[0]*mel->ne[1];
+
+        wstate0.inp_mel.resize(ggml_nelements(mel));
+
+        // note: with the windowed mel, the windows of the same state are computed one after the other
+        for (int ib = 0; ib < n_batch; ++ib) {
+            auto & wstate = *windows[ib].wstate;
+
+            assert(wstate.mel.n_mel == wctx.model.hparams.n_mels);
+
+            if (!whisper_mel_update_window(wctx, wstate, windows[ib].mel_offset, n_ctx)) {
+                WHISPER_LOG_ERROR("%s: failed to compute the mel spectrogram\n", __func__);
+                return false;
+            }
+
+            whisper_mel_get_window(wstate.mel, windows[ib].mel_offset, n_ctx, wstate0.inp_mel.data() + ib*n_window);
+        }
+
+        ggml_backend_tensor_set(mel, wstate0.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+    }
+
+    if (!ggml_graph_compute_helper(wsched.sched, gf, n_threads)) {
+        return false;
+    }
+
+    // the time is split between the windows
+    const int64_t t_encode_us = ggml_time_us() - t_start_us;
+
+    for (const auto & window : windows) {
+        window.wstate->t_encode_us += t_encode_us/n_batch;
+        window.wstate->n_encode++;
+    }
+
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
+
+// [EXPERIMENTAL] batched encoder in whisper_full() - allocate the caches of n_ahead windows encoded ahead of the
+// current one, and forget the windows of the previous calls
+static bool whisper_encode_ahead_init(whisper_context & ctx, whisper_state & state, int n_ahead) {
+    const auto & hparams = ctx.model.hparams;
+
+    // note: the tensors of a cache are in its ctx_buf, so the caches are created in place and only moved
+    while ((int) state.kv_cross_ahead.size() < n_ahead) {
+        state.kv_cross_ahead.emplace_back();
+        state.kv_pad_ahead.emplace_back();
+
+        if (!whisper_kv_cache_init(state.kv_cross_ahead.back(), state.backends[0], ctx.itype,
+                    hparams.n_text_state,
+                    hparams.n_text_layer,
+                    GGML_PAD(hparams.n_audio_ctx, 256))) {
+            WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for cross-attention cache\n", __func__);
+            state.kv_cross_ahead.pop_back();
+            state.kv_pad_ahead.pop_back();
+            return false;
+        }
+
+        if (!whisper_kv_cache_init(state.kv_pad_ahead.back(), state.backends[0], ctx.itype,
+                    hparams.n_audio_state,
+                    1,
+                    GGML_PAD(hparams.n_audio_ctx, 256))) {
+            WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+            whisper_kv_cache_free(state.kv_cross_ahead.back());
+            state.kv_cross_ahead.pop_back();
+            state.kv_pad_ahead.pop_back();
+            return false;
+        }
+    }
+
+    state.seek_ahead.assign(state.kv_cross_ahead.size(), -1);
+
+    return true;
+}
+
+// a part of the tokens evaluated by the decoder graph
+//
+// with continuous batching, the steps of several states are merged into a single graph - the token embeddings,
+// projections, MLP and output logits are evaluated for all tokens at once, while the self- and cross-attention of
+// each part use the KV caches of its state
+struct whisper_decoder_part {
+    whisper_state       * wstate = nullptr;
+    const whisper_batch * batch  = nullptr;
+
+    int i_token = 0; // offset of the tokens of the part in the graph
+
+    bool restrict_logits = false; // [EXPERIMENTAL] restricted vocabulary
+    bool reduce_logits   = false; // [EXPERIMENTAL] greedy_on_device
+};
+
+// the inputs and outputs of the decoder graph are numbered by part (e.g. "KQ_mask_1"), unless there is only one
+static std::string whisper_decoder_part_name(const char * name, int i_part, int n_parts) {
+    return n_parts == 1 ? std::string(name) : std::string(name) + "_" + std::to_string(i_part);
+}
 
-    WHISPER_ASSERT(!!kv_self.buffer);
+static struct ggml_cgraph * whisper_build_graph_decoder(
+                         whisper_context & wctx,
+                           whisper_sched & wsched,
+    const std::vector<whisper_decoder_part> & parts,
+                                    bool   save_alignment_heads_QKs,
+                                    bool   worst_case) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    const int n_ctx   = kv_self.size;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
     const int n_state_head = n_state/n_head;
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_parts = parts.size();
 
-    const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
+    int n_tokens = 0;
+    for (const auto & part : parts) {
+        WHISPER_ASSERT(!!part.wstate->kv_self.buffer);
+        WHISPER_ASSERT(part.i_token == n_tokens);
+
+        n_tokens += part.batch->n_tokens;
+    }
 
-    const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
+    // [EXPERIMENTAL] Token-level timestamps with DTW - single state only
+    const bool dtw = wctx.params.dtw_token_timestamps && n_parts == 1;
 
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
+        /*.mem_size   =*/ wsched.meta.size(),
+        /*.mem_buffer =*/ wsched.meta.data(),
         /*.no_alloc   =*/ true,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES*n_parts, false);
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
     ggml_set_name(embd, "embd");
@@ -2523,11 +3737,21 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     const float KQscale = pow(float(n_state_head), -0.25);
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+    // one self-attention mask per part
+    std::vector<struct ggml_tensor *> KQ_mask    (n_parts);
+    std::vector<struct ggml_tensor *> KQ_mask_f16(n_parts);
+
+    for (int r = 0; r < n_parts; ++r) {
+        const auto & kv_self = parts[r].wstate->kv_self;
+
+        const int32_t n_kv = worst_case ? kv_self.size : kv_self.n;
+
+        KQ_mask[r] = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(parts[r].batch->n_tokens, GGML_KQ_MASK_PAD), 1);
+        ggml_set_name(KQ_mask[r], whisper_decoder_part_name("KQ_mask", r, n_parts).c_str());
+        ggml_set_input(KQ_mask[r]);
 
-    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+        KQ_mask_f16[r] = ggml_cast(ctx0, KQ_mask[r], GGML_TYPE_F16);
+    }
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -2574,84 +3798,107 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             Kcur = ggml_scale(ctx0, Kcur, KQscale);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
+            struct ggml_tensor * attn = nullptr;
 
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+            for (int r = 0; r < n_parts; ++r) {
+                auto & kv_self = parts[r].wstate->kv_self;
 
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+                const int n_tok = parts[r].batch->n_tokens;
+                const int i_tok = parts[r].i_token;
 
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                const int32_t n_ctx   = kv_self.size;
+                const int32_t n_kv    = worst_case ? n_ctx         : kv_self.n;
+                const int32_t kv_head = worst_case ? n_ctx - n_tok : kv_self.head;
 
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
-                }
+                struct ggml_tensor * Qcur_r = ggml_view_2d(ctx0, Qcur, n_state, n_tok, Qcur->nb[1], i_tok*Qcur->nb[1]);
+                struct ggml_tensor * Kcur_r = ggml_view_2d(ctx0, Kcur, n_state, n_tok, Kcur->nb[1], i_tok*Kcur->nb[1]);
+                struct ggml_tensor * Vcur_r = ggml_view_2d(ctx0, Vcur, n_state, n_tok, Vcur->nb[1], i_tok*Vcur->nb[1]);
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                // store key and value to memory
+                {
+                    struct ggml_tensor * k;
+                    struct ggml_tensor * v;
 
-            // ------
+                    if (wctx.params.flash_attn) {
+                        k = ggml_view_1d(ctx0, kv_self.k, n_tok*n_state,
+                                (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                        v = ggml_view_1d(ctx0, kv_self.v, n_tok*n_state,
+                                (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                    } else {
+                        Vcur_r = ggml_transpose(ctx0, Vcur_r);
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        k = ggml_view_1d(ctx0, kv_self.k, n_tok*n_state,
+                                (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                        v = ggml_view_2d(ctx0, kv_self.v, n_tok, n_state,
+                                (   n_ctx)*ggml_element_size(kv_self.v),
+                                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                    }
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur_r, k));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur_r, v));
+                }
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                // ------
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f, 0.0f);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, Qcur_r, n_state_head, n_head, n_tok),
+                            0, 2, 1, 3);
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_kv, n_state_head, n_head,
-                            n_ctx*ggml_element_size(kv_self.v),
-                            n_ctx*ggml_element_size(kv_self.v)*n_state_head,
-                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state_head, n_kv, n_head,
+                            ggml_element_size(kv_self.k)*n_state,
+                            ggml_element_size(kv_self.k)*n_state_head,
+                            ggml_element_size(kv_self.k)*n_state*n_ctx*il);
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * cur_r;
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_state_head, n_kv, n_head,
+                                ggml_element_size(kv_self.v)*n_state,
+                                ggml_element_size(kv_self.v)*n_state_head,
+                                ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+
+                    cur_r = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16[r], 1.0f, 0.0f, 0.0f);
+
+                    cur_r = ggml_reshape_2d(ctx0, cur_r, n_state, n_tok);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask[r], 1.0f, 0.0f);
+
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_kv, n_state_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    cur_r = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tok);
+                }
+
+                attn = attn ? ggml_concat(ctx0, attn, cur_r, 1) : cur_r;
             }
+
+            cur = attn;
         }
 
         // projection
@@ -2690,75 +3937,95 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                         Qcur,
                         layer.cross_attn_q_b);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+            struct ggml_tensor * attn = nullptr;
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
-
-                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
-
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_audio_ctx, n_state_head, n_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+            for (int r = 0; r < n_parts; ++r) {
+                const auto & wstate = *parts[r].wstate;
 
-                // ------
+                const int n_audio_ctx     = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+                const int n_tok = parts[r].batch->n_tokens;
+                const int i_tok = parts[r].i_token;
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+                struct ggml_tensor * Qcur_r = ggml_view_2d(ctx0, Qcur, n_state, n_tok, Qcur->nb[1], i_tok*Qcur->nb[1]);
 
-                // [EXPERIMENTAL] Token-level timestamps with DTW
-                if (wctx.params.dtw_token_timestamps) {
-                    if (wstate.aheads_masks.m[il] != nullptr) {
-                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
-                        if (aheads_cross_QKs == NULL) {
-                            aheads_cross_QKs = aheads_KQs;
-                        } else {
-                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, Qcur_r, n_state_head, n_head, n_tok),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * cur_r;
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.k,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state,
+                                ggml_element_size(wstate.kv_cross.k)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.v,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(wstate.kv_cross.v)*n_state,
+                                ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+
+                    cur_r = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
+
+                    cur_r = ggml_reshape_2d(ctx0, cur_r, n_state, n_tok);
+                } else {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.k,
+                                n_state_head, n_audio_ctx, n_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state,
+                                ggml_element_size(wstate.kv_cross.k)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.v,
+                                n_audio_ctx, n_state_head, n_head,
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+
+                    // ------
+
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+
+                    // [EXPERIMENTAL] Token-level timestamps with DTW
+                    if (dtw) {
+                        if (wstate.aheads_masks.m[il] != nullptr) {
+                            struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
+                            if (aheads_cross_QKs == NULL) {
+                                aheads_cross_QKs = aheads_KQs;
+                            } else {
+                                aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                            }
                         }
                     }
-                }
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    cur_r = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tok);
+                }
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+                attn = attn ? ggml_concat(ctx0, attn, cur_r, 1) : cur_r;
             }
+
+            cur = attn;
         }
 
         // projection
@@ -2834,25 +4101,355 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     // might be useful in the future
     //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
-
     // [EXPERIMENTAL] Token-level timestamps with DTW
-    if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
+    if (dtw && aheads_cross_QKs != nullptr) {
         aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
         aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
         if (save_alignment_heads_QKs) {
             ggml_build_forward_expand(gf, aheads_cross_QKs);
-            wstate.aheads_cross_QKs = aheads_cross_QKs;
+            parts[0].wstate->aheads_cross_QKs = aheads_cross_QKs;
         }
     }
 
-    ggml_build_forward_expand(gf, logits);
+    // the parts without a restricted vocabulary share the projection onto the token embeddings, unless one of them has
+    bool logits_shared = true;
+    for (const auto & part : parts) {
+        logits_shared = logits_shared && !part.restrict_logits;
+    }
+
+    struct ggml_tensor * logits_all = logits_shared ? ggml_mul_mat(ctx0, model.d_te, cur) : nullptr;
+
+    if (logits_all && n_parts > 1) {
+        ggml_set_output(logits_all);
+    }
+
+    for (int r = 0; r < n_parts; ++r) {
+        const auto & part = parts[r];
+
+        const int n_tok = part.batch->n_tokens;
+
+        struct ggml_tensor * logits = nullptr;
+
+        if (logits_all && n_parts == 1) {
+            logits = logits_all;
+        } else if (logits_all) {
+            logits = ggml_view_2d(ctx0, logits_all, logits_all->ne[0], n_tok, logits_all->nb[1], part.i_token*logits_all->nb[1]);
+        } else {
+            struct ggml_tensor * cur_r = ggml_view_2d(ctx0, cur, n_state, n_tok, cur->nb[1], part.i_token*cur->nb[1]);
+
+            if (part.restrict_logits) {
+                // [EXPERIMENTAL] restricted vocabulary - project only onto the embeddings of the allowed tokens
+                logits = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, model.d_te, part.wstate->logits_restrict.ids), cur_r);
+            } else {
+                logits = ggml_mul_mat(ctx0, model.d_te, cur_r);
+            }
+        }
+
+        ggml_set_name(logits, whisper_decoder_part_name("logits", r, n_parts).c_str());
+        ggml_set_output(logits);
+        ggml_build_forward_expand(gf, logits);
+
+        // [EXPERIMENTAL] greedy_on_device - apply the static suppression and reduce the text tokens [0, token_eot)
+        // to their argmax, max and the soft_max probability of the argmax, since logsumexp = max - log(p_max)
+        if (part.reduce_logits) {
+            GGML_ASSERT(n_tok == 1);
+
+            const int n_text = wctx.vocab.token_eot;
+
+            struct ggml_tensor * masked = ggml_add(ctx0, logits, part.wstate->logits_reduce.bias);
+            ggml_set_name(masked, whisper_decoder_part_name("logits_masked", r, n_parts).c_str());
+            ggml_set_output(masked);
+
+            struct ggml_tensor * text = ggml_view_1d(ctx0, masked, n_text, 0);
+
+            struct ggml_tensor * text_id = ggml_argmax(ctx0, text);
+            ggml_set_name(text_id, whisper_decoder_part_name("logits_text_id", r, n_parts).c_str());
+            ggml_set_output(text_id);
+
+            struct ggml_tensor * text_max = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, text, 1, n_text), text_id);
+            ggml_set_name(text_max, whisper_decoder_part_name("logits_text_max", r, n_parts).c_str());
+            ggml_set_output(text_max);
+
+            struct ggml_tensor * text_pmax = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, ggml_soft_max(ctx0, text), 1, n_text), text_id);
+            ggml_set_name(text_pmax, whisper_decoder_part_name("logits_text_pmax", r, n_parts).c_str());
+            ggml_set_output(text_pmax);
+
+            ggml_build_forward_expand(gf, masked);
+            ggml_build_forward_expand(gf, text_max);
+            ggml_build_forward_expand(gf, text_pmax);
+        }
+    }
 
     ggml_free(ctx0);
 
     return gf;
 }
 
+// set the inputs of the graph built by whisper_build_graph_decoder()
+static void whisper_decoder_set_inputs(ggml_cgraph * gf, const std::vector<whisper_decoder_part> & parts) {
+    const int n_parts = parts.size();
+
+    struct ggml_tensor * embd     = ggml_graph_get_tensor(gf, "embd");
+    struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
+
+    for (int r = 0; r < n_parts; ++r) {
+        const auto & batch = *parts[r].batch;
+
+        auto & wstate = *parts[r].wstate;
+
+        ggml_backend_tensor_set(embd,     batch.token, parts[r].i_token*ggml_element_size(embd),     batch.n_tokens*ggml_element_size(embd));
+        ggml_backend_tensor_set(position, batch.pos,   parts[r].i_token*ggml_element_size(position), batch.n_tokens*ggml_element_size(position));
+
+        struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, whisper_decoder_part_name("KQ_mask", r, n_parts).c_str());
+
+        wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+
+        whisper_kv_cache_build_mask(wstate.kv_self, batch, wstate.inp_mask.data());
+
+        ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+    }
+}
+
+// copy the logits of each part from the outputs of the graph built by whisper_build_graph_decoder() to its state
+static void whisper_decoder_get_logits(const whisper_context & wctx, ggml_cgraph * gf, const std::vector<whisper_decoder_part> & parts) {
+    const int n_vocab = wctx.model.hparams.n_vocab;
+    const int n_parts = parts.size();
+
+    for (int r = 0; r < n_parts; ++r) {
+        const auto & part  = parts[r];
+        const auto & batch = *part.batch;
+
+        auto & wstate = *part.wstate;
+
+        const int n_tokens = batch.n_tokens;
+
+        auto & logits_out = wstate.logits;
+
+        struct ggml_tensor * logits = ggml_graph_get_tensor(gf, whisper_decoder_part_name("logits", r, n_parts).c_str());
+
+        if (part.reduce_logits) {
+            auto & reduce = wstate.logits_reduce;
+
+            const int n_text = wctx.vocab.token_eot;
+
+            int32_t text_id   = 0;
+            float   text_max  = 0.0f;
+            float   text_pmax = 0.0f;
+
+            ggml_backend_tensor_get(ggml_graph_get_tensor(gf, whisper_decoder_part_name("logits_text_id",   r, n_parts).c_str()), &text_id,   0, sizeof(text_id));
+            ggml_backend_tensor_get(ggml_graph_get_tensor(gf, whisper_decoder_part_name("logits_text_max",  r, n_parts).c_str()), &text_max,  0, sizeof(text_max));
+            ggml_backend_tensor_get(ggml_graph_get_tensor(gf, whisper_decoder_part_name("logits_text_pmax", r, n_parts).c_str()), &text_pmax, 0, sizeof(text_pmax));
+
+            reduce.text_id  = text_id;
+            reduce.text_max = text_max;
+            reduce.text_lse = text_max == -INFINITY ? -INFINITY : text_max - logf(text_pmax);
+
+            reduce.tail.resize(n_vocab - n_text);
+            ggml_backend_tensor_get(ggml_graph_get_tensor(gf, whisper_decoder_part_name("logits_masked", r, n_parts).c_str()), reduce.tail.data(), sizeof(float)*n_text, sizeof(float)*reduce.tail.size());
+        } else if (part.restrict_logits) {
+            const auto & allowed = wstate.logits_suppress.allowed;
+
+            const int n_allowed = allowed.size();
+
+            auto & buf = wstate.logits_restrict.buf;
+            buf.resize(n_allowed);
+
+            logits_out.resize(n_tokens*n_vocab);
+            for (int i = 0; i < n_tokens; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
+                }
+                ggml_backend_tensor_get(logits, buf.data(), sizeof(float)*(n_allowed*i), sizeof(float)*n_allowed);
+
+                float * row = logits_out.data() + n_vocab*i;
+
+                std::fill(row, row + n_vocab, -INFINITY);
+                for (int k = 0; k < n_allowed; ++k) {
+                    row[allowed[k]] = buf[k];
+                }
+            }
+        } else {
+            logits_out.resize(n_tokens*n_vocab);
+            for (int i = 0; i < n_tokens; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
+                }
+                ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+            }
+        }
+    }
+}
+
+static void whisper_decode_update_timings(whisper_state & wstate, int n_tokens, int64_t t_start_us) {
+    if (n_tokens == 1) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    } else if (n_tokens < 16) {
+        wstate.t_batchd_us += ggml_time_us() - t_start_us;
+        wstate.n_batchd += n_tokens;
+    } else {
+        wstate.t_prompt_us += ggml_time_us() - t_start_us;
+        wstate.n_prompt += n_tokens;
+    }
+}
+
+// [EXPERIMENTAL] continuous batching of the decoder across states
+//
+// the pending decoder steps of all states attached to the same whisper_batch_sched are merged into a single
+// decoder graph, with one whisper_decoder_part per state
+//
+
+struct whisper_batch_sched_req {
+    whisper_state       * wstate = nullptr;
+    const whisper_batch * batch  = nullptr;
+
+    bool done = false;
+    bool ok   = false;
+};
+
+struct whisper_batch_sched {
+    whisper_context * ctx = nullptr;
+
+    int n_states_max = 1;
+    int n_threads    = 1;
+    int n_prev       = 0; // number of requests merged in the previous evaluation
+
+    std::vector<ggml_backend_t> backends;
+
+    whisper_sched sched;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    bool busy = false; // a merged batch is currently being evaluated
+
+    std::deque<whisper_batch_sched_req *> queue;
+};
+
+// max time to wait for the states served in the previous step to submit their next step
+#define WHISPER_BATCH_SCHED_WAIT_US 2000
+
+// evaluate the given requests as a single merged batch
+// the result of each request is stored in req->ok and the logits are written to the state of the request
+static void whisper_batch_sched_eval(whisper_batch_sched & bsched, const std::vector<whisper_batch_sched_req *> & reqs_all) {
+    auto & wctx = *bsched.ctx;
+
+    std::vector<whisper_batch_sched_req *> reqs;
+    reqs.reserve(reqs_all.size());
+
+    std::vector<whisper_decoder_part> parts;
+    parts.reserve(reqs_all.size());
+
+    int n_tokens = 0;
+
+    // find KV slot for the batch of each state
+    for (auto * req : reqs_all) {
+        auto & wstate  = *req->wstate;
+        auto & kv_self = wstate.kv_self;
+
+        req->ok = false;
+
+        if (!whisper_kv_cache_find_slot(kv_self, *req->batch, !wctx.params.flash_attn)) {
+            continue;
+        }
+
+        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+
+        whisper_decoder_part part;
+        part.wstate          = &wstate;
+        part.batch           = req->batch;
+        part.i_token         = n_tokens;
+        part.restrict_logits = wstate.logits_restrict.enabled;
+        part.reduce_logits   = wstate.logits_reduce.enabled && req->batch->n_tokens == 1;
+
+        n_tokens += req->batch->n_tokens;
+
+        reqs.push_back(req);
+        parts.push_back(part);
+    }
+
+    if (reqs.empty()) {
+        return;
+    }
+
+    auto & sched = bsched.sched.sched;
+
+    ggml_cgraph * gf = whisper_build_graph_decoder(wctx, bsched.sched, parts, false, false);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return;
+    }
+
+    whisper_decoder_set_inputs(gf, parts);
+
+    if (!ggml_graph_compute_helper(sched, gf, bsched.n_threads)) {
+        return;
+    }
+
+    whisper_decoder_get_logits(wctx, gf, parts);
+
+    for (auto * req : reqs) {
+        req->ok = true;
+    }
+}
+
+// submit the batch of a state to the scheduler and wait for its logits
+// the first waiting thread that finds the scheduler idle evaluates the pending batches of all states
+static bool whisper_batch_sched_decode(whisper_batch_sched & bsched, whisper_state & wstate, const whisper_batch & batch) {
+    whisper_batch_sched_req req;
+    req.wstate = &wstate;
+    req.batch  = &batch;
+
+    std::unique_lock<std::mutex> lock(bsched.mutex);
+
+    bsched.queue.push_back(&req);
+    bsched.cv.notify_all();
+
+    while (!req.done) {
+        if (bsched.busy) {
+            bsched.cv.wait(lock);
+            continue;
+        }
+
+        // give the states served in the previous step a chance to submit their next step
+        const int n_wait = std::min(bsched.n_prev, bsched.n_states_max);
+
+        bsched.cv.wait_for(lock, std::chrono::microseconds(WHISPER_BATCH_SCHED_WAIT_US), [&] {
+            return req.done || bsched.busy || (int) bsched.queue.size() >= n_wait;
+        });
+
+        if (req.done || bsched.busy) {
+            continue;
+        }
+
+        std::vector<whisper_batch_sched_req *> reqs;
+        while (!bsched.queue.empty() && (int) reqs.size() < bsched.n_states_max) {
+            reqs.push_back(bsched.queue.front());
+            bsched.queue.pop_front();
+        }
+
+        bsched.busy   = true;
+        bsched.n_prev = reqs.size();
+
+        lock.unlock();
+
+        whisper_batch_sched_eval(bsched, reqs);
+
+        lock.lock();
+
+        for (auto * r : reqs) {
+            r->done = true;
+        }
+
+        bsched.busy = false;
+        bsched.cv.notify_all();
+    }
+
+    return req.ok;
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2873,21 +4470,36 @@ static bool whisper_decode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    // [EXPERIMENTAL] continuous batching - merge this step with the pending steps of the other states
+    if (wstate.batch_sched && !save_alignment_heads_QKs) {
+        if (!whisper_batch_sched_decode(*wstate.batch_sched, wstate, batch)) {
+            return false;
+        }
+
+        whisper_decode_update_timings(wstate, batch.n_tokens, t_start_us);
+
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
 
-    const int n_vocab  = hparams.n_vocab;
     const int n_tokens = batch.n_tokens;
 
-    auto & logits_out = wstate.logits;
+    whisper_decoder_part part;
+    part.wstate = &wstate;
+    part.batch  = &batch;
 
-    struct ggml_tensor * logits;
+    // [EXPERIMENTAL] restricted vocabulary
+    part.restrict_logits = wstate.logits_restrict.enabled;
+
+    // [EXPERIMENTAL] greedy_on_device
+    part.reduce_logits = wstate.logits_reduce.enabled && n_tokens == 1 && !save_alignment_heads_QKs;
+
+    const std::vector<whisper_decoder_part> parts = { part };
 
     // find KV slot for the batch
     {
         auto & kv_self = wstate.kv_self;
 
-        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+        if (!whisper_kv_cache_find_slot(kv_self, batch, !wctx.params.flash_attn)) {
             return false;
         }
 
@@ -2902,7 +4514,7 @@ static bool whisper_decode_internal(
     {
         auto & sched = wstate.sched_decode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate.sched_decode, parts, save_alignment_heads_QKs, false);
 
         if (!ggml_backend_sched_alloc_graph(sched, gf)) {
             // should never happen as we pre-allocate the memory
@@ -2910,66 +4522,13 @@ static bool whisper_decode_internal(
         }
 
         // set the inputs
-        {
-            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
-            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-        }
-
-        {
-            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
-        }
-
-        {
-            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
-
-            auto & kv_self = wstate.kv_self;
-
-            const int32_t n_kv = kv_self.n;
-
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
-
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
-
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
-
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
-
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
-                }
-            }
-
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
-        }
-
-        logits = ggml_graph_node(gf, -1);
+        whisper_decoder_set_inputs(gf, parts);
 
         if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
             return false;
         }
-    }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+        whisper_decoder_get_logits(wctx, gf, parts);
     }
 
     if (batch.n_tokens > 1) {
@@ -2981,16 +4540,7 @@ static bool whisper_decode_internal(
         //        wstate.get_buf_max_mem(3)/1e6);
     }
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
-    }
+    whisper_decode_update_timings(wstate, n_tokens, t_start_us);
 
     return !(abort_callback && abort_callback(abort_callback_data));
 }
@@ -3012,176 +4562,469 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
+// number of frames that are transformed together by whisper_fft_plan::run()
+// the data of the frames is interleaved, so that every butterfly processes WHISPER_FFT_LANES frames at once
+#define WHISPER_FFT_LANES 8
+
 namespace {
-struct whisper_global_cache {
-    // In FFT, we frequently use sine and cosine operations with the same values.
-    // We can use precalculated values to speed up the process.
-    float sin_vals[SIN_COS_N_COUNT];
-    float cos_vals[SIN_COS_N_COUNT];
+// real-input FFT with a precomputed plan
+//
+// the n real samples are packed into a complex sequence of size m = n/2 (even samples -> re, odd samples -> im),
+// which is transformed with an iterative mixed-radix (4, 2, 5, generic) Cooley-Tukey FFT and then split into
+// the n/2 + 1 bins of the real FFT
+//
+// ref: https://www.fftw.org/fftw-paper-ieee.pdf
+struct whisper_fft_plan {
+    int n = 0; // real input size
+    int m = 0; // complex FFT size
+
+    std::vector<int> radix; // radix of each stage, in the order of execution
+    std::vector<int> perm;  // input permutation (mixed-radix digit reversal)
+
+    // per-stage twiddle factors, tw[tw_off[s] + k*(p - 1) + q - 1] = exp(-2*pi*i*q*k/(l*p)) for stage s with radix p
+    std::vector<int>   tw_off;
+    std::vector<float> tw_re;
+    std::vector<float> tw_im;
+
+    // twiddle factors for splitting the packed complex FFT, exp(-2*pi*i*k/n) for k in [0, m]
+    std::vector<float> rt_re;
+    std::vector<float> rt_im;
+
+    void init(int n_real) {
+        n = n_real;
+        m = n/2;
+
+        GGML_ASSERT(n > 1 && n % 2 == 0);
+
+        // factorize, outermost radix first
+        std::vector<int> factors;
+        for (int r = m; r > 1; ) {
+            int p = 0;
+            for (int c : { 4, 2, 5, 3 }) {
+                if (r % c == 0) {
+                    p = c;
+                    break;
+                }
+            }
+            if (p == 0) {
+                for (p = 7; r % p != 0; p += 2) {}
+            }
+            factors.push_back(p);
+            r /= p;
+        }
 
-    // Hann window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    float hann_window[WHISPER_N_FFT];
+        radix.assign(factors.rbegin(), factors.rend());
 
-    whisper_global_cache() {
-        fill_sin_cos_table();
-        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
-    }
+        perm.resize(m);
+        build_perm(perm.data(), m, 1, 0, factors.data());
+
+        tw_off.clear();
+        tw_re .clear();
+        tw_im .clear();
+
+        for (int s = 0, l = 1; s < (int) radix.size(); ++s) {
+            const int p = radix[s];
+
+            tw_off.push_back(tw_re.size());
+
+            for (int k = 0; k < l; ++k) {
+                for (int q = 1; q < p; ++q) {
+                    const double theta = -2.0*M_PI*q*k/(l*p);
+                    tw_re.push_back(cos(theta));
+                    tw_im.push_back(sin(theta));
+                }
+            }
 
-    void fill_sin_cos_table() {
-        for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-            double theta = (2 * M_PI * i) / SIN_COS_N_COUNT;
-            sin_vals[i] = sinf(theta);
-            cos_vals[i] = cosf(theta);
+            l *= p;
+        }
+
+        rt_re.resize(m + 1);
+        rt_im.resize(m + 1);
+
+        for (int k = 0; k <= m; ++k) {
+            const double theta = -2.0*M_PI*k/n;
+            rt_re[k] = cos(theta);
+            rt_im[k] = sin(theta);
         }
     }
 
-    void fill_hann_window(int length, bool periodic, float * output) {
-        int offset = -1;
-        if (periodic) {
-            offset = 0;
+    // position j of the permuted sequence holds the input element perm[j]
+    static void build_perm(int * dst, int len, int stride, int offset, const int * factors) {
+        if (len == 1) {
+            dst[0] = offset;
+            return;
         }
-        for (int i = 0; i < length; i++) {
-            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+
+        const int p  = factors[0];
+        const int ls = len/p;
+
+        for (int q = 0; q < p; ++q) {
+            build_perm(dst + q*ls, ls, stride*p, offset + q*stride, factors + 1);
         }
     }
-} global_cache;
-}
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    // power spectrum of WHISPER_FFT_LANES frames
+    // frame f is read from in[f*in_step .. f*in_step + n_in[f]), multiplied by the window and zero padded to n samples
+    // re, im - work buffers of m*WHISPER_FFT_LANES floats
+    // out    - (n/2 + 1)*WHISPER_FFT_LANES floats, out[k*WHISPER_FFT_LANES + f] = |X_f[k]|^2
+    void run(const float * in, int in_step, const int * n_in, const float * window, float * re, float * im, float * out) const {
+        const int L = WHISPER_FFT_LANES;
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+        // pack and permute the input
+        for (int j = 0; j < m; ++j) {
+            const int i0 = 2*perm[j] + 0;
+            const int i1 = 2*perm[j] + 1;
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
+            for (int f = 0; f < L; ++f) {
+                re[j*L + f] = i0 < n_in[f] ? window[i0]*in[f*in_step + i0] : 0.0f;
+                im[j*L + f] = i1 < n_in[f] ? window[i1]*in[f*in_step + i1] : 0.0f;
+            }
         }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        // butterflies
+        for (int s = 0, l = 1; s < (int) radix.size(); ++s) {
+            const int p = radix[s];
+
+            const float * wr = tw_re.data() + tw_off[s];
+            const float * wi = tw_im.data() + tw_off[s];
+
+            for (int b = 0; b < m; b += l*p) {
+                for (int k = 0; k < l; ++k) {
+                    float * xr = re + (b + k)*L;
+                    float * xi = im + (b + k)*L;
+
+                    const float * twr = wr + k*(p - 1);
+                    const float * twi = wi + k*(p - 1);
+
+                    switch (p) {
+                        case 2: butterfly_2(xr, xi, l*L, twr, twi); break;
+                        case 4: butterfly_4(xr, xi, l*L, twr, twi); break;
+                        case 5: butterfly_5(xr, xi, l*L, twr, twi); break;
+                        default: butterfly_n(xr, xi, l*L, twr, twi, p); break;
+                    }
+                }
+            }
+
+            l *= p;
+        }
+
+        // split into the bins of the real FFT
+        //   X[k] = E[k] + exp(-2*pi*i*k/n)*O[k]
+        //   E[k] = (Z[k] + conj(Z[m - k]))/2
+        //   O[k] = (Z[k] - conj(Z[m - k]))/(2i)
+        for (int k = 0; k <= m; ++k) {
+            const float * ar = re + (k % m)*L;
+            const float * ai = im + (k % m)*L;
+            const float * br = re + ((m - k) % m)*L;
+            const float * bi = im + ((m - k) % m)*L;
+
+            const float cr = rt_re[k];
+            const float ci = rt_im[k];
+
+            for (int f = 0; f < L; ++f) {
+                const float er = 0.5f*(ar[f] + br[f]);
+                const float ei = 0.5f*(ai[f] - bi[f]);
+                const float or_ = 0.5f*(ai[f] + bi[f]);
+                const float oi  = 0.5f*(br[f] - ar[f]);
+
+                const float xr = er + cr*or_ - ci*oi;
+                const float xi = ei + cr*oi  + ci*or_;
+
+                out[k*L + f] = xr*xr + xi*xi;
+            }
+        }
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    // x[q*stride + f] *= tw[q - 1] for q in [1, p)
+    static inline void twiddle(float * xr, float * xi, int stride, const float * twr, const float * twi, int p) {
+        for (int q = 1; q < p; ++q) {
+            const float cr = twr[q - 1];
+            const float ci = twi[q - 1];
+
+            float * yr = xr + q*stride;
+            float * yi = xi + q*stride;
+
+            for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+                const float r = yr[f];
+                const float i = yi[f];
+
+                yr[f] = r*cr - i*ci;
+                yi[f] = r*ci + i*cr;
+            }
+        }
     }
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
+    static void butterfly_2(float * xr, float * xi, int stride, const float * twr, const float * twi) {
+        twiddle(xr, xi, stride, twr, twi, 2);
+
+        float * r0 = xr; float * r1 = xr + stride;
+        float * i0 = xi; float * i1 = xi + stride;
+
+        for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+            const float ar = r0[f], ai = i0[f];
+            const float br = r1[f], bi = i1[f];
+
+            r0[f] = ar + br; i0[f] = ai + bi;
+            r1[f] = ar - br; i1[f] = ai - bi;
+        }
+    }
+
+    static void butterfly_4(float * xr, float * xi, int stride, const float * twr, const float * twi) {
+        twiddle(xr, xi, stride, twr, twi, 4);
+
+        float * r0 = xr; float * r1 = xr + stride; float * r2 = xr + 2*stride; float * r3 = xr + 3*stride;
+        float * i0 = xi; float * i1 = xi + stride; float * i2 = xi + 2*stride; float * i3 = xi + 3*stride;
+
+        for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+            const float s02r = r0[f] + r2[f], s02i = i0[f] + i2[f];
+            const float d02r = r0[f] - r2[f], d02i = i0[f] - i2[f];
+            const float s13r = r1[f] + r3[f], s13i = i1[f] + i3[f];
+            const float d13r = r1[f] - r3[f], d13i = i1[f] - i3[f];
+
+            r0[f] = s02r + s13r; i0[f] = s02i + s13i;
+            r2[f] = s02r - s13r; i2[f] = s02i - s13i;
+
+            // -i*d13 and +i*d13
+            r1[f] = d02r + d13i; i1[f] = d02i - d13r;
+            r3[f] = d02r - d13i; i3[f] = d02i + d13r;
+        }
     }
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
+    static void butterfly_5(float * xr, float * xi, int stride, const float * twr, const float * twi) {
+        static const float c1 =  0.309016994374947f; // cos(2*pi/5)
+        static const float c2 = -0.809016994374947f; // cos(4*pi/5)
+        static const float s1 =  0.951056516295154f; // sin(2*pi/5)
+        static const float s2 =  0.587785252292473f; // sin(4*pi/5)
+
+        twiddle(xr, xi, stride, twr, twi, 5);
+
+        float * r0 = xr; float * r1 = xr + stride; float * r2 = xr + 2*stride; float * r3 = xr + 3*stride; float * r4 = xr + 4*stride;
+        float * i0 = xi; float * i1 = xi + stride; float * i2 = xi + 2*stride; float * i3 = xi + 3*stride; float * i4 = xi + 4*stride;
+
+        for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+            const float t1r = r1[f] + r4[f], t1i = i1[f] + i4[f];
+            const float t2r = r2[f] + r3[f], t2i = i2[f] + i3[f];
+            const float t3r = r1[f] - r4[f], t3i = i1[f] - i4[f];
+            const float t4r = r2[f] - r3[f], t4i = i2[f] - i3[f];
+
+            const float b1r = r0[f] + c1*t1r + c2*t2r, b1i = i0[f] + c1*t1i + c2*t2i;
+            const float b2r = r0[f] + c2*t1r + c1*t2r, b2i = i0[f] + c2*t1i + c1*t2i;
+
+            const float d1r = s1*t3r + s2*t4r, d1i = s1*t3i + s2*t4i;
+            const float d2r = s2*t3r - s1*t4r, d2i = s2*t3i - s1*t4i;
+
+            r0[f] += t1r + t2r;
+            i0[f] += t1i + t2i;
+
+            // b -/+ i*d
+            r1[f] = b1r + d1i; i1[f] = b1i - d1r;
+            r4[f] = b1r - d1i; i4[f] = b1i + d1r;
+            r2[f] = b2r + d2i; i2[f] = b2i - d2r;
+            r3[f] = b2r - d2i; i3[f] = b2i + d2r;
+        }
     }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
+    // odd radices without a specialized butterfly - naive DFT
+    static void butterfly_n(float * xr, float * xi, int stride, const float * twr, const float * twi, int p) {
+        twiddle(xr, xi, stride, twr, twi, p);
+
+        std::vector<float> yr(p*WHISPER_FFT_LANES, 0.0f);
+        std::vector<float> yi(p*WHISPER_FFT_LANES, 0.0f);
+
+        for (int r = 0; r < p; ++r) {
+            for (int q = 0; q < p; ++q) {
+                const double theta = -2.0*M_PI*((r*q) % p)/p;
+                const float cr = cos(theta);
+                const float ci = sin(theta);
+
+                for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+                    yr[r*WHISPER_FFT_LANES + f] += xr[q*stride + f]*cr - xi[q*stride + f]*ci;
+                    yi[r*WHISPER_FFT_LANES + f] += xr[q*stride + f]*ci + xi[q*stride + f]*cr;
+                }
+            }
+        }
+
+        for (int r = 0; r < p; ++r) {
+            for (int f = 0; f < WHISPER_FFT_LANES; ++f) {
+                xr[r*stride + f] = yr[r*WHISPER_FFT_LANES + f];
+                xi[r*stride + f] = yi[r*WHISPER_FFT_LANES + f];
+            }
+        }
     }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+};
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+struct whisper_global_cache {
+    // Hann window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    float hann_window[WHISPER_N_FFT];
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    // plan for the real-input FFT of the frames of the spectrogram
+    whisper_fft_plan fft_plan;
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+    whisper_global_cache() {
+        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        fft_plan.init(WHISPER_N_FFT);
+    }
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    void fill_hann_window(int length, bool periodic, float * output) {
+        int offset = -1;
+        if (periodic) {
+            offset = 0;
+        }
+        for (int i = 0; i < length; i++) {
+            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+        }
     }
+} global_cache;
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
+// compute the log-mel frames [0, n_frames) - frame i starts at samples[i*frame_step]
+// only the first n_samples samples are read, the rest are assumed to be zero
+// the output of mel band j is stored in dst[j*dst_stride + i]
+// returns the maximum of the values written by this thread, for the normalization
+static float log_mel_spectrogram_worker_thread(int ith, const float * hann, const float * samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+                                              const whisper_filters & filters, int n_frames, float * dst, int dst_stride) {
+    const auto & plan = global_cache.fft_plan;
+
+    const int L = WHISPER_FFT_LANES;
+
+    std::vector<float> fft_re(plan.m * L);
+    std::vector<float> fft_im(plan.m * L);
+    std::vector<float> fft_out((plan.m + 1) * L);
 
     int n_fft = filters.n_fft;
-    int i = ith;
 
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
     assert(n_fft == 1 + (frame_size / 2));
+    assert(plan.n == frame_size);
 
     // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+    const int n_mel = filters.n_mel;
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
+    std::vector<double> sum(n_mel * L);
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+    float mmax = -1e20f;
+
+    const int n_frames_fft = std::min(n_samples > 0 ? n_samples / frame_step + 1 : 0, n_frames);
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+    // the frames are processed in groups of L
+    for (int g = ith; g*L < n_frames_fft; g += n_threads) {
+        const int i0 = g*L;
+        const int nf = std::min(L, n_frames_fft - i0);
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+        int n_in[WHISPER_FFT_LANES];
+        for (int f = 0; f < L; ++f) {
+            n_in[f] = f < nf ? std::max(0, std::min(frame_size, n_samples - (i0 + f)*frame_step)) : 0;
         }
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+        // FFT + modulus^2 of the complex numbers
+        plan.run(samples + i0*frame_step, frame_step, n_in, hann, fft_re.data(), fft_im.data(), fft_out.data());
+
+        // mel spectrogram - only the non-zero span of each filter contributes
+        for (int j = 0; j < n_mel; j++) {
+            double * s = sum.data() + j*L;
+
+            std::fill(s, s + L, 0.0);
+
+            const float * filter = filters.data.data() + j * n_fft;
+
+            for (int k = filters.span_begin[j]; k < filters.span_end[j]; k++) {
+                const float w = filter[k];
+                for (int f = 0; f < L; ++f) {
+                    s[f] += fft_out[k*L + f] * w;
+                }
             }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+        }
+
+        // log10 of the whole block in a separate pass
+        for (int j = 0; j < n_mel; j++) {
+            const double * s = sum.data() + j*L;
+
+            for (int f = 0; f < nf; ++f) {
+                const float v = log10(std::max(s[f], 1e-10));
+
+                dst[j * dst_stride + i0 + f] = v;
+                mmax = std::max(mmax, v);
             }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
         }
     }
 
     // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+    double sum_zero = log10(1e-10);
+    for (int i = n_frames_fft + ith; i < n_frames; i += n_threads) {
+        for (int j = 0; j < n_mel; j++) {
+            dst[j * dst_stride + i] = sum_zero;
         }
+        mmax = std::max(mmax, (float) sum_zero);
     }
+
+    return mmax;
+}
+
+// returns the maximum of the computed values - the partial maxima of the threads are reduced at the end
+static float log_mel_spectrogram_frames(whisper_thread_pool & pool, const float * hann, const float * samples, int n_samples, int frame_size, int frame_step, int n_threads,
+                                        const whisper_filters & filters, int n_frames, float * dst, int dst_stride) {
+    std::vector<float> mmax(n_threads, -1e20f);
+
+    pool.run(n_threads, [&](int ith) {
+        mmax[ith] = log_mel_spectrogram_worker_thread(ith, hann, samples, n_samples, frame_size, frame_step, n_threads, filters, n_frames, dst, dst_stride);
+    });
+
+    return *std::max_element(mmax.begin(), mmax.end());
+}
+
+// clamping and normalization, given the maximum of the data
+static void log_mel_spectrogram_normalize(whisper_thread_pool & pool, int n_threads, float * data, size_t n, float data_max) {
+    const double mmax = (double) data_max - 8.0;
+
+    const size_t chunk = (n + n_threads - 1)/n_threads;
+
+    pool.run(n_threads, [&](int ith) {
+        const size_t i0 = std::min(n, ith*chunk);
+        const size_t i1 = std::min(n, i0 + chunk);
+
+        for (size_t i = i0; i < i1; i++) {
+            if (data[i] < mmax) {
+                data[i] = mmax;
+            }
+
+            data[i] = (data[i] + 4.0)/4.0;
+        }
+    });
+}
+
+// compute the log-mel frames [a, b) of n_samples input samples, padded as in log_mel_spectrogram()
+// sample(i) returns the input sample i - only the samples used by the frames are accessed
+// the frame i is stored in dst[j*dst_stride + (i - a)], buf is a scratch buffer
+// returns the maximum of the computed values
+template <typename F>
+static float log_mel_spectrogram_frames_padded(whisper_thread_pool & pool, int n_threads, const whisper_filters & filters,
+                                               const F & sample, int64_t n_samples, int a, int b, float * dst, int dst_stride, std::vector<float> & buf) {
+    if (a >= b) {
+        return -1e20f;
+    }
+
+    const int frame_size  = WHISPER_N_FFT;
+    const int frame_step  = WHISPER_HOP_LENGTH;
+    const int stage_2_pad = frame_size / 2;
+
+    // the input samples padded as in log_mel_spectrogram(), starting at frame a
+    const int64_t p0 = (int64_t) a*frame_step;
+    const int64_t p1 = std::min<int64_t>(n_samples + stage_2_pad, (int64_t) (b - 1)*frame_step + frame_size);
+
+    buf.resize(std::max<int64_t>(0, p1 - p0));
+    for (int64_t p = p0; p < p1; ++p) {
+        if (p < stage_2_pad) {
+            // reflective pad at the beginning of the audio
+            buf[p - p0] = stage_2_pad - p < n_samples ? sample(stage_2_pad - p) : 0.0f;
+        } else {
+            buf[p - p0] = sample(p - stage_2_pad);
+        }
+    }
+
+    return log_mel_spectrogram_frames(pool, global_cache.hann_window, buf.data(), p1 - p0, frame_size, frame_step, n_threads, filters, b - a, dst, dst_stride);
 }
 
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
@@ -3203,77 +5046,280 @@ static bool log_mel_spectrogram(
     WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
     const float * hann = global_cache.hann_window;
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.offset    = 0;
+    mel.n_frames  = mel.n_len;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    const float mmax = log_mel_spectrogram_frames(wstate.pool, hann, samples_padded.data(), n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel.n_len, mel.data.data(), mel.n_len);
+
+    log_mel_spectrogram_normalize(wstate.pool, n_threads, mel.data.data(), mel.data.size(), mmax);
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
+
+    return true;
+}
+
+// [EXPERIMENTAL] prepare the state for computing the mel spectrogram of the samples one window at a time
+// the samples are not copied, so they must stay valid while the state is used for encoding
+static void whisper_mel_init_window(whisper_state & wstate, const float * samples, int n_samples, int n_mel, int n_threads) {
+    auto & mel = wstate.mel;
+
+    mel.n_mel    = n_mel;
+    mel.offset   = 0;
+    mel.n_frames = 0;
+    mel.data.clear();
+
+    auto & src = wstate.mel_src;
+
+    src = {};
+
+    src.samples   = samples;
+    src.n_samples = n_samples;
+    src.n_threads = n_threads;
+    src.eof       = true;
+
+    // same number of frames as log_mel_spectrogram()
+    mel.n_len     = (n_samples + WHISPER_SAMPLE_RATE*30) / WHISPER_HOP_LENGTH;
+    mel.n_len_org = 1 + (n_samples - WHISPER_N_FFT/2) / WHISPER_HOP_LENGTH;
+}
+
+// [EXPERIMENTAL] same as whisper_mel_init_window(), but the samples are pulled from the reader when needed
+// until the end of the audio is reached, the length of the spectrogram is unknown and reported as INT_MAX/2
+static void whisper_mel_init_source(whisper_state & wstate, whisper_audio_source reader, int n_mel, int n_threads, bool energy) {
+    whisper_mel_init_window(wstate, nullptr, 0, n_mel, n_threads);
+
+    auto & src = wstate.mel_src;
+
+    src.reader = reader;
+    src.eof    = false;
+    src.energy = energy;
+
+    wstate.mel.n_len     = INT_MAX/2;
+    wstate.mel.n_len_org = INT_MAX/2;
+
+    wstate.energy.clear();
+    wstate.energy_offset = 0;
+}
+
+// [EXPERIMENTAL] read the samples that are needed to compute the n_frames mel frames at mel_offset
+static bool whisper_mel_source_fill(whisper_state & wstate, int mel_offset, int n_frames) {
+    auto & src = wstate.mel_src;
+
+    if (src.reader.read == nullptr) {
+        return true;
+    }
+
+    const int frame_size  = WHISPER_N_FFT;
+    const int frame_step  = WHISPER_HOP_LENGTH;
+    const int stage_2_pad = frame_size / 2;
+
+    const int hw     = 32;                    // half window of the signal energy - see get_signal_energy()
+    const int hw_vad = WHISPER_SAMPLE_RATE/8; // the token-level timestamps look this far before a token
+
+    // range of samples used by the window
+    const int64_t s0 = (int64_t) mel_offset*frame_step - stage_2_pad;
+    const int64_t s1 = (int64_t) (mel_offset + n_frames - 1)*frame_step + frame_size - stage_2_pad;
+
+    if (s0 > (int64_t) src.head.size() && s0 < src.buf_offset) {
+        WHISPER_LOG_ERROR("%s: the audio source cannot seek backwards\n", __func__);
+        return false;
+    }
+
+    // drop the samples before the window that are no longer needed
+    {
+        int64_t n_drop = s0 - src.buf_offset;
+        if (src.energy) {
+            n_drop = std::min<int64_t>(n_drop, src.n_energy - hw - src.buf_offset);
+        }
+
+        n_drop = std::min<int64_t>(n_drop, src.buf.size());
+
+        if (n_drop > 0) {
+            src.buf.erase(src.buf.begin(), src.buf.begin() + n_drop);
+            src.buf_offset += n_drop;
+        }
+    }
+
+    // and their signal energy, except for the last hw_vad samples before the window
+    if (src.energy) {
+        const int64_t n_drop = std::min<int64_t>(s0 - hw_vad - wstate.energy_offset, wstate.energy.size());
+
+        if (n_drop > 0) {
+            wstate.energy.erase(wstate.energy.begin(), wstate.energy.begin() + n_drop);
+            wstate.energy_offset += n_drop;
+        }
+    }
+
+    while (!src.eof && src.n_samples < s1) {
+        const int n_read = (int) std::max<int64_t>(s1 - src.n_samples, WHISPER_SAMPLE_RATE);
+
+        const size_t n_buf = src.buf.size();
+        src.buf.resize(n_buf + n_read);
+
+        int ret = src.reader.read(src.buf.data() + n_buf, n_read, src.reader.user_data);
+        if (ret < 0) {
+            WHISPER_LOG_ERROR("%s: failed to read from the audio source (%d)\n", __func__, ret);
+            src.buf.resize(n_buf);
+            return false;
+        }
+
+        ret = std::min(ret, n_read);
+
+        src.buf.resize(n_buf + ret);
+
+        if (src.n_samples < stage_2_pad + 1) {
+            for (int i = src.n_samples; i < std::min(src.n_samples + ret, stage_2_pad + 1); ++i) {
+                src.head.push_back(src.buf[i - src.buf_offset]);
+            }
+        }
+
+        src.n_samples += ret;
+
+        if (ret == 0) {
+            src.eof = true;
+
+            wstate.mel.n_len     = (src.n_samples + WHISPER_SAMPLE_RATE*30) / WHISPER_HOP_LENGTH;
+            wstate.mel.n_len_org = 1 + (src.n_samples - WHISPER_N_FFT/2) / WHISPER_HOP_LENGTH;
+        }
+    }
+
+    // signal energy of the samples for which the whole window has been read
+    if (src.energy) {
+        const int n_end = src.eof ? src.n_samples : src.n_samples - hw;
+
+        wstate.energy.resize(std::max(n_end, src.n_energy) - wstate.energy_offset);
+
+        for (int i = src.n_energy; i < n_end; ++i) {
+            float sum = 0;
+            for (int j = -hw; j <= hw; j++) {
+                if (i + j >= 0 && i + j < src.n_samples) {
+                    sum += fabs(src.buf[i + j - src.buf_offset]);
+                }
+            }
+            wstate.energy[i - wstate.energy_offset] = sum/(2*hw + 1);
+        }
+
+        src.n_energy = std::max(n_end, src.n_energy);
+    }
+
+    return true;
+}
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+// make sure that the mel frames needed to encode the window at mel_offset are available
+// no-op unless the mel spectrogram is computed one window at a time
+//
+// note: the normalization uses the maximum of the window instead of the maximum of the whole input,
+//       so the result can differ slightly from whisper_pcm_to_mel()
+static bool whisper_mel_update_window(const whisper_context & wctx, whisper_state & wstate, int mel_offset, int n_ctx) {
+    auto & src = wstate.mel_src;
+    auto & mel = wstate.mel;
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+    if (src.samples == nullptr && src.reader.read == nullptr) {
+        return true;
+    }
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+    if (!whisper_mel_source_fill(wstate, mel_offset, 2*n_ctx)) {
+        return false;
+    }
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+    const int i0 = std::min(mel_offset,           mel.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel.n_len);
+    const int n  = i1 - i0;
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
+    if (mel.offset == i0 && mel.n_frames == n) {
+        return true;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    const auto & filters = wctx.model.filters;
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
+    // sample i of the input audio
+    auto sample = [&](int64_t i) {
+        if (src.samples) {
+            return src.samples[i];
         }
-    }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+        if (i < (int64_t) src.head.size()) {
+            return src.head[i];
         }
-    }
 
-    mmax -= 8.0;
+        return src.buf[i - src.buf_offset];
+    };
+
+    std::vector<float> raw(mel.n_mel*n);
+    std::vector<float> buf;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+    float mmax = -1e20f;
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    // compute the frames [a, b) of the window
+    auto compute = [&](int a, int b) {
+        mmax = std::max(mmax, log_mel_spectrogram_frames_padded(wstate.pool, src.n_threads, filters, sample, src.n_samples, a, b, raw.data() + (a - i0), n, buf));
+    };
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+    // reuse the frames that overlap with the previous window
+    const int o0 = std::max(i0, src.offset);
+    const int o1 = std::min(i1, src.offset + src.n_frames);
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
+    if (o0 < o1) {
+        for (int j = 0; j < mel.n_mel; ++j) {
+            const float * x = src.raw.data() + j*src.n_frames + (o0 - src.offset);
+
+            memcpy(raw.data() + j*n + (o0 - i0), x, (o1 - o0)*sizeof(float));
+
+            mmax = std::max(mmax, *std::max_element(x, x + (o1 - o0)));
         }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
+
+        compute(i0, o0);
+        compute(o1, i1);
+    } else {
+        compute(i0, i1);
     }
 
+    src.offset   = i0;
+    src.n_frames = n;
+    src.raw      = raw;
+
+    mel.offset   = i0;
+    mel.n_frames = n;
+    mel.data     = std::move(raw);
+
+    log_mel_spectrogram_normalize(wstate.pool, src.n_threads, mel.data.data(), mel.data.size(), mmax);
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
     return true;
 }
 
@@ -3405,7 +5451,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
-                GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
+                whisper_kv_self_n_ctx(*ctx, 1))) {
         WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
         whisper_free_state(state);
         return nullptr;
@@ -3547,7 +5593,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
                     whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
+                    whisper_decoder_part part;
+                    part.wstate = state;
+                    part.batch  = &state->batch;
+
+                    return whisper_build_graph_decoder(*ctx, state->sched_decode, { part }, ctx->params.dtw_token_timestamps, true);
                 });
 
         if (!ok) {
@@ -3562,6 +5612,59 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     return state;
 }
 
+struct whisper_batch_sched * whisper_batch_sched_init(struct whisper_context * ctx, int n_states_max, int n_threads) {
+    if (n_states_max < 1) {
+        WHISPER_LOG_ERROR("%s: invalid number of states: %d\n", __func__, n_states_max);
+        return nullptr;
+    }
+
+    whisper_batch_sched * bsched = new whisper_batch_sched;
+
+    bsched->ctx          = ctx;
+    bsched->n_states_max = n_states_max;
+    bsched->n_threads    = std::max(1, n_threads);
+
+    bsched->backends = whisper_backend_init(ctx->params);
+    if (bsched->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_batch_sched_free(bsched);
+        return nullptr;
+    }
+
+    // the compute buffer is allocated on the first evaluation and grows with the size of the merged batches
+    const size_t n_nodes = (size_t) WHISPER_MAX_NODES*n_states_max;
+
+    bsched->sched.sched = ggml_backend_sched_new(bsched->backends.data(), nullptr, bsched->backends.size(), n_nodes, false, true);
+    bsched->sched.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+
+    WHISPER_LOG_INFO("%s: n_states_max = %d, n_threads = %d\n", __func__, bsched->n_states_max, bsched->n_threads);
+
+    return bsched;
+}
+
+void whisper_batch_sched_free(struct whisper_batch_sched * bsched) {
+    if (bsched) {
+        ggml_backend_sched_free(bsched->sched.sched);
+
+        for (auto & backend : bsched->backends) {
+            ggml_backend_free(backend);
+        }
+
+        delete bsched;
+    }
+}
+
+int whisper_state_set_batch_sched(struct whisper_context * ctx, struct whisper_state * state, struct whisper_batch_sched * bsched) {
+    if (bsched && bsched->ctx != ctx) {
+        WHISPER_LOG_ERROR("%s: the batch scheduler belongs to a different context\n", __func__);
+        return -1;
+    }
+
+    state->batch_sched = bsched;
+
+    return 0;
+}
+
 int whisper_ctx_init_openvino_encoder_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -3635,12 +5738,59 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.use_mmap             =*/ true,
+        /*.use_mlock            =*/ false,
     };
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping);
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap && whisper_mmap::SUPPORTED) {
+        std::unique_ptr<whisper_mmap> mapping(new whisper_mmap);
+
+        if (mapping->open(path_model, params.use_mlock)) {
+            whisper_model_loader loader = {};
+
+            loader.context = mapping.get();
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+                const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+                memcpy(output, (const char *) mapping->addr + mapping->pos, size_to_copy);
+                mapping->pos += size_to_copy;
+
+                return size_to_copy;
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+                return mapping->pos >= mapping->size;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            auto ctx = whisper_init_with_params_no_state_impl(&loader, params, std::move(mapping));
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to mmap '%s' - falling back to reading the file\n", __func__, path_model);
+    }
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3720,7 +5870,10 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
     return whisper_init_with_params_no_state(&loader, params);
 }
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping) {
     ggml_time_init();
 
     if (params.flash_attn && params.dtw_token_timestamps) {
@@ -3732,11 +5885,13 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: mmap       = %d\n", __func__, mapping != nullptr);
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
     WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->model.mapping = std::move(mapping);
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
@@ -3750,6 +5905,10 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     return ctx;
 }
 
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
+}
+
 struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
     whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
     if (!ctx) {
@@ -3825,6 +5984,13 @@ void whisper_free_state(struct whisper_state * state) {
         whisper_kv_cache_free(state->kv_cross);
         whisper_kv_cache_free(state->kv_pad);
 
+        for (auto & kv : state->kv_cross_ahead) {
+            whisper_kv_cache_free(kv);
+        }
+        for (auto & kv : state->kv_pad_ahead) {
+            whisper_kv_cache_free(kv);
+        }
+
 #ifdef WHISPER_USE_COREML
         if (state->ctx_coreml != nullptr) {
             whisper_coreml_free(state->ctx_coreml);
@@ -3845,6 +6011,7 @@ void whisper_free_state(struct whisper_state * state) {
         ggml_backend_sched_free(state->sched_encode.sched);
         ggml_backend_sched_free(state->sched_cross.sched);
         ggml_backend_sched_free(state->sched_decode.sched);
+        ggml_backend_sched_free(state->sched_encode_batch.sched);
 
         for (auto & backend : state->backends) {
             ggml_backend_free(backend);
@@ -3853,6 +6020,14 @@ void whisper_free_state(struct whisper_state * state) {
         // [EXPERIMENTAL] Token-level timestamps with DTW
         aheads_masks_free(state->aheads_masks);
 
+        ggml_free(state->logits_reduce.ctx);
+        ggml_backend_buffer_free(state->logits_reduce.buffer);
+
+        ggml_free(state->logits_restrict.ctx);
+        ggml_backend_buffer_free(state->logits_restrict.buffer);
+
+        whisper_free_state(state->draft_state);
+
         delete state;
     }
 }
@@ -3879,56 +6054,335 @@ void whisper_free_context_params(struct whisper_context_params * params) {
     }
 }
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
-    }
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->mel_src = {};
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+        return -1;
+    }
+
+    state->mel_src = {};
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+    state->mel.offset    = 0;
+    state->mel.n_frames  = n_len;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+//
+// [EXPERIMENTAL] incremental log mel spectrogram
+//
+
+struct whisper_mel_stream {
+    const whisper_filters * filters = nullptr;
+
+    int n_threads = 1;
+
+    whisper_thread_pool pool;
+
+    int64_t t_mel_us = 0; // time spent in whisper_mel_stream_push() since the last whisper_mel_stream_set()
+
+    // number of samples pushed so far
+    int64_t n_total = 0;
+
+    // the retained samples [s_begin, n_total) are stored in samples[s_skip, ...)
+    // the dropped samples are erased lazily, once they take up half of the buffer
+    int64_t s_begin = 0;
+    size_t  s_skip  = 0;
+
+    std::vector<float> samples;
+
+    // the computed frames [f_begin, f_end) - frame i is stored in column (i - f_base) of raw, with a row stride of f_cap
+    // only the frames that do not overlap with the padding are cached, i.e. frames i >= 2 that are complete
+    int64_t f_begin = 2;
+    int64_t f_end   = 2;
+    int64_t f_base  = 2;
+    int     f_cap   = 0;
+
+    std::vector<float> raw;     // log-mel values before the normalization
+    std::vector<float> raw_max; // maximum of each frame
+
+    std::vector<float> buf;
+};
+
+// first frame that is not affected by the reflective padding
+#define WHISPER_MEL_STREAM_F0 2
+
+static_assert(WHISPER_MEL_STREAM_F0*WHISPER_HOP_LENGTH >= WHISPER_N_FFT/2, "frame WHISPER_MEL_STREAM_F0 overlaps with the padding");
+
+// make room for the frames [f_begin, f_end_new) - the frames are moved to the front of the buffer, which grows if needed
+static void whisper_mel_stream_reserve(whisper_mel_stream & ms, int64_t f_end_new) {
+    if (f_end_new - ms.f_base <= ms.f_cap) {
+        return;
+    }
+
+    const int n_mel = ms.filters->n_mel;
+    const int n     = ms.f_end - ms.f_begin;
+
+    // keep at least half of the buffer free, so that the frames are moved only once in a while
+    const int cap = std::max<int64_t>(ms.f_cap, 2*(f_end_new - ms.f_begin));
+
+    std::vector<float> raw    (n_mel*cap);
+    std::vector<float> raw_max(cap);
+
+    for (int j = 0; j < n_mel; ++j) {
+        memcpy(raw.data() + j*cap, ms.raw.data() + j*ms.f_cap + (ms.f_begin - ms.f_base), n*sizeof(float));
+    }
+    memcpy(raw_max.data(), ms.raw_max.data() + (ms.f_begin - ms.f_base), n*sizeof(float));
+
+    ms.raw     = std::move(raw);
+    ms.raw_max = std::move(raw_max);
+    ms.f_base  = ms.f_begin;
+    ms.f_cap   = cap;
+}
+
+struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx, int n_threads) {
+    whisper_mel_stream * ms = new whisper_mel_stream;
+
+    ms->filters   = &ctx->model.filters;
+    ms->n_threads = std::max(1, n_threads);
+
+    return ms;
+}
+
+void whisper_mel_stream_free(struct whisper_mel_stream * stream) {
+    delete stream;
+}
+
+int whisper_mel_stream_push(struct whisper_mel_stream * stream, const float * samples, int n_samples) {
+    if (n_samples < 0) {
+        WHISPER_LOG_ERROR("%s: invalid number of samples: %d\n", __func__, n_samples);
+        return -1;
+    }
+
+    auto & ms = *stream;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int frame_size  = WHISPER_N_FFT;
+    const int frame_step  = WHISPER_HOP_LENGTH;
+    const int stage_2_pad = frame_size / 2;
+
+    ms.samples.insert(ms.samples.end(), samples, samples + n_samples);
+    ms.n_total += n_samples;
+
+    // frame i is complete once the samples up to i*frame_step + stage_2_pad are available
+    const int64_t f_end_new = ms.n_total >= stage_2_pad ? (ms.n_total - stage_2_pad)/frame_step + 1 : 0;
+
+    if (f_end_new > ms.f_end) {
+        whisper_mel_stream_reserve(ms, f_end_new);
+
+        const int n_mel = ms.filters->n_mel;
+        const int n_new = f_end_new - ms.f_end;
+
+        // the first sample of frame f_end
+        const int64_t s0 = ms.f_end*frame_step - stage_2_pad;
+
+        float * dst = ms.raw.data() + (ms.f_end - ms.f_base);
+
+        log_mel_spectrogram_frames(ms.pool, global_cache.hann_window, ms.samples.data() + ms.s_skip + (s0 - ms.s_begin), ms.n_total - s0,
+                frame_size, frame_step, ms.n_threads, *ms.filters, n_new, dst, ms.f_cap);
+
+        for (int i = 0; i < n_new; ++i) {
+            float vmax = -1e20f;
+            for (int j = 0; j < n_mel; ++j) {
+                vmax = std::max(vmax, dst[j*ms.f_cap + i]);
+            }
+            ms.raw_max[ms.f_end - ms.f_base + i] = vmax;
+        }
+
+        ms.f_end = f_end_new;
+    }
+
+    ms.t_mel_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_mel_stream_drop(struct whisper_mel_stream * stream, int n_samples) {
+    auto & ms = *stream;
+
+    int64_t n_drop = std::min<int64_t>(std::max(0, n_samples), ms.n_total - ms.s_begin);
+    n_drop -= n_drop % WHISPER_HOP_LENGTH;
+
+    ms.s_begin += n_drop;
+    ms.s_skip  += n_drop;
+
+    if (ms.s_skip > ms.samples.size()/2) {
+        ms.samples.erase(ms.samples.begin(), ms.samples.begin() + ms.s_skip);
+        ms.s_skip = 0;
+    }
+
+    // the first frames of the retained samples overlap with the padding, so they are recomputed by whisper_mel_stream_set()
+    ms.f_begin = std::max(ms.f_begin, ms.s_begin/WHISPER_HOP_LENGTH + WHISPER_MEL_STREAM_F0);
+    ms.f_end   = std::max(ms.f_end, ms.f_begin);
+
+    return n_drop;
+}
+
+int whisper_mel_stream_n_samples(const struct whisper_mel_stream * stream) {
+    return stream->n_total - stream->s_begin;
+}
+
+int whisper_mel_stream_set_with_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_mel_stream * stream) {
+    auto & ms  = *stream;
+    auto & mel = state->mel;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int frame_size  = WHISPER_N_FFT;
+    const int frame_step  = WHISPER_HOP_LENGTH;
+    const int stage_2_pad = frame_size / 2;
+
+    const int n_mel = ctx->model.filters.n_mel;
+    const int n     = ms.n_total - ms.s_begin;
+
+    const float * x = ms.samples.data() + ms.s_skip;
+
+    state->mel_src = {};
+
+    // same layout as log_mel_spectrogram()
+    mel.n_mel     = n_mel;
+    mel.n_len     = (n + WHISPER_SAMPLE_RATE*30) / frame_step;
+    mel.n_len_org = 1 + (n + stage_2_pad - frame_size) / frame_step;
+    mel.offset    = 0;
+    mel.n_frames  = mel.n_len;
+    mel.data.resize(n_mel*mel.n_len);
+
+    // the frames that log_mel_spectrogram() computes with an FFT - the rest are silence
+    const int n_frames_fft = std::min((n + stage_2_pad) / frame_step + 1, mel.n_len);
+
+    // the cached frames [WHISPER_MEL_STREAM_F0, n_cached) - the frame i of the stream is the frame i - f_offs of the retained samples
+    const int64_t f_offs = ms.s_begin/frame_step;
+
+    const int n_cached = std::max<int>(WHISPER_MEL_STREAM_F0, std::min<int64_t>(n_frames_fft, ms.f_end - f_offs));
+
+    auto sample = [&](int64_t i) {
+        return x[i];
+    };
+
+    float mmax = -1e20f;
+
+    // head (reflective padding) and tail (zero padding)
+    mmax = std::max(mmax, log_mel_spectrogram_frames_padded(ms.pool, ms.n_threads, *ms.filters, sample, n,
+                0, std::min(n_frames_fft, WHISPER_MEL_STREAM_F0), mel.data.data(), mel.n_len, ms.buf));
+
+    mmax = std::max(mmax, log_mel_spectrogram_frames_padded(ms.pool, ms.n_threads, *ms.filters, sample, n,
+                n_cached, n_frames_fft, mel.data.data() + n_cached, mel.n_len, ms.buf));
+
+    if (n_cached > WHISPER_MEL_STREAM_F0) {
+        const int64_t c0 = WHISPER_MEL_STREAM_F0 + f_offs - ms.f_base;
+        const int     nc = n_cached - WHISPER_MEL_STREAM_F0;
+
+        for (int j = 0; j < n_mel; ++j) {
+            memcpy(mel.data.data() + j*mel.n_len + WHISPER_MEL_STREAM_F0, ms.raw.data() + j*ms.f_cap + c0, nc*sizeof(float));
+        }
+
+        mmax = std::max(mmax, *std::max_element(ms.raw_max.begin() + c0, ms.raw_max.begin() + c0 + nc));
+    }
+
+    // silence
+    if (n_frames_fft < mel.n_len) {
+        const float v = log10(1e-10);
+
+        for (int j = 0; j < n_mel; ++j) {
+            std::fill(mel.data.begin() + j*mel.n_len + n_frames_fft, mel.data.begin() + (j + 1)*mel.n_len, v);
+        }
+
+        mmax = std::max(mmax, v);
+    }
+
+    log_mel_spectrogram_normalize(ms.pool, ms.n_threads, mel.data.data(), mel.data.size(), mmax);
+
+    state->t_mel_us += ggml_time_us() - t_start_us + ms.t_mel_us;
+    ms.t_mel_us = 0;
+
+    return 0;
+}
+
+int whisper_mel_stream_set(struct whisper_context * ctx, struct whisper_mel_stream * stream) {
+    return whisper_mel_stream_set_with_state(ctx, ctx->state, stream);
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return -1;
     }
 
     return 0;
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
-
-int whisper_set_mel_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != ctx->model.filters.n_mel) {
-        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_states, int n_threads) {
+    if (n_states < 1) {
+        WHISPER_LOG_ERROR("%s: invalid number of states: %d\n", __func__, n_states);
         return -1;
     }
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+    std::vector<whisper_encode_window> windows(n_states);
+    for (int i = 0; i < n_states; ++i) {
+        windows[i] = { states[i], offsets[i], &states[i]->kv_cross, &states[i]->kv_pad };
+    }
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    // external encoders and states with different audio context are evaluated one window at a time
+    bool batched = n_states > 1;
+    for (int i = 0; i < n_states; ++i) {
+        if (whisper_encode_external(*states[i]) || states[i]->exp_n_audio_ctx != states[0]->exp_n_audio_ctx) {
+            batched = false;
+        }
+    }
 
-    return 0;
-}
+    if (!batched) {
+        for (int i = 0; i < n_states; ++i) {
+            if (!whisper_encode_internal(*ctx, *states[i], offsets[i], n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+                return -1;
+            }
+        }
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+        return 0;
+    }
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+    if (!whisper_encode_batch_internal(*ctx, windows, n_threads, nullptr, nullptr)) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return -1;
     }
@@ -4265,6 +6719,13 @@ struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
     timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
     timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
     timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+    timings->load_ms       = 1e-3f * ctx->t_load_us;
+    timings->load_meta_ms  = 1e-3f * ctx->t_load_meta_us;
+    timings->load_alloc_ms = 1e-3f * ctx->t_load_alloc_us;
+    timings->load_data_ms  = 1e-3f * ctx->t_load_data_us;
+    timings->draft_ms       = 1e-3f * ctx->state->t_draft_us;
+    timings->draft_n        = ctx->state->n_draft;
+    timings->draft_n_accept = ctx->state->n_draft_accept;
     return timings;
 }
 
@@ -4272,7 +6733,8 @@ void whisper_print_timings(struct whisper_context * ctx) {
     const int64_t t_end_us = ggml_time_us();
 
     WHISPER_LOG_INFO("\n");
-    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    WHISPER_LOG_INFO("%s:     load time = %8.2f ms ( meta %.2f ms, alloc %.2f ms, data %.2f ms )\n", __func__, ctx->t_load_us / 1000.0f,
+            ctx->t_load_meta_us / 1000.0f, ctx->t_load_alloc_us / 1000.0f, ctx->t_load_data_us / 1000.0f);
     if (ctx->state != nullptr) {
 
         const int32_t n_sample = std::max(1, ctx->state->n_sample);
@@ -4281,13 +6743,17 @@ void whisper_print_timings(struct whisper_context * ctx) {
         const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
         const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
 
-        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h / %3d r\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h, ctx->state->n_fail_r);
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d tokens, %5d accepted ( %6.2f %%)\n", __func__, 1e-3f * ctx->state->t_draft_us,
+                    ctx->state->n_draft, ctx->state->n_draft_accept, 100.0f*ctx->state->n_draft_accept/ctx->state->n_draft);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -4306,6 +6772,9 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->t_draft_us     = 0;
+        ctx->state->n_draft        = 0;
+        ctx->state->n_draft_accept = 0;
     }
 }
 
@@ -5928,6 +8397,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.mel_window        =*/ false,
+        /*.greedy_on_device  =*/ false,
+        /*.encode_batch      =*/ 0,
 
         /*.tdrz_enable       =*/ false,
 
@@ -5952,6 +8424,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.logprob_thold     =*/ -1.0f,
         /*.no_speech_thold   =*/  0.6f,
 
+        /*.rep_n_tokens      =*/ 0,
+        /*.rep_ngram_max     =*/ 8,
+
         /*.greedy            =*/ {
             /*.best_of   =*/ -1,
         },
@@ -5982,6 +8457,12 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.i_start_rule    =*/ 0,
         /*.grammar_penalty =*/ 100.0f,
 
+        /*.allowed_tokens   =*/ nullptr,
+        /*.allowed_n_tokens =*/ 0,
+
+        /*.draft_ctx      =*/ nullptr,
+        /*.draft_n_tokens =*/ 0,
+
         /*.vad                         =*/ false,
         /*.vad_model_path              =*/ nullptr,
 
@@ -6000,136 +8481,409 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                 result.beam_search = {
                     /*.beam_size =*/ 5,
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
+
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return txt[0] == ' ';
+}
+
+static void whisper_exp_compute_token_level_timestamps_dtw(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+        struct whisper_full_params   params,
+                               int   i_segment,
+                            size_t   n_segments,
+                               int   seek,
+                               int   n_frames,
+                               int   medfilt_width,
+                               int   n_threads);
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+//
+// kernels for the logits processing
+//
+// these run over the full vocabulary for every decoder at every sampled token, so the exp / sum loops use the
+// vectorized soft_max of the CPU backend, obtained with ggml_backend_reg_get_proc_address() - scalar fallback without it
+//
+
+// y = exp(x - max), returns sum(y)
+static double whisper_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
+    static const ggml_backend_cpu_vec_soft_max_f32_t soft_max_fn = []() -> ggml_backend_cpu_vec_soft_max_f32_t {
+        ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+
+        return reg ? (ggml_backend_cpu_vec_soft_max_f32_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_vec_soft_max_f32") : nullptr;
+    }();
+
+    if (soft_max_fn) {
+        return soft_max_fn(n, y, x, max);
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
+    }
+
+    return sum;
+}
+
+// max(x[0..n))
+static float whisper_vec_max_f32(const int n, const float * x) {
+    float res = -INFINITY;
+    for (int i = 0; i < n; ++i) {
+        res = std::max(res, x[i]);
+    }
+
+    return res;
+}
+
+// log(sum(exp(x[0..n)))) - -INFINITY entries contribute nothing, returns -INFINITY if all entries are -INFINITY
+// tmp is overwritten with n values
+static float whisper_vec_logsumexp_f32(const int n, const float * x, float * tmp) {
+    const float max = whisper_vec_max_f32(n, x);
+    if (max == -INFINITY) {
+        return -INFINITY;
+    }
+
+    return logf(whisper_vec_soft_max_f32(n, tmp, x, max)) + max;
+}
+
+// y = log_softmax(x)
+static void whisper_vec_log_softmax_f32(const int n, float * y, const float * x) {
+    const float lse = whisper_vec_logsumexp_f32(n, x, y);
+    if (lse == -INFINITY) {
+        std::fill(y, y + n, -INFINITY);
+        return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        y[i] = x[i] - lse;
+    }
+}
+
+// y = exp(x)
+static void whisper_vec_exp_f32(const int n, float * y, const float * x) {
+    whisper_vec_soft_max_f32(n, y, x, 0.0f);
+}
+
+static void whisper_compute_logprobs(
+                const std::vector<float> & logits,
+                              const int    n_logits,
+                      std::vector<float> & logprobs) {
+    whisper_vec_log_softmax_f32(n_logits, logprobs.data(), logits.data());
+}
+
+// suppressed tokens have logprobs == -INFINITY, so they get probs == 0.0f
+static void whisper_compute_probs(
+                              const int    n_logits,
+                const std::vector<float> & logprobs,
+                      std::vector<float> & probs) {
+    whisper_vec_exp_f32(n_logits, probs.data(), logprobs.data());
+}
+
+// build the static logits suppression for the params, unless it is already built for the same params
+static void whisper_logits_suppress_init(
+              struct whisper_context & ctx,
+    const struct whisper_full_params & params,
+      struct whisper_logits_suppress & sup) {
+    const auto & vocab = ctx.vocab;
+
+    const int n_logits = vocab.id_to_token.size();
+
+    const std::string suppress_regex = params.suppress_regex ? params.suppress_regex : "";
+
+    // [EXPERIMENTAL] restricted vocabulary
+    std::vector<whisper_token> allowed;
+    if (params.allowed_tokens != nullptr && params.allowed_n_tokens > 0) {
+        for (int i = 0; i < params.allowed_n_tokens; ++i) {
+            const whisper_token id = params.allowed_tokens[i];
+            if (id < 0 || id >= n_logits) {
+                WHISPER_LOG_WARN("%s: ignoring invalid allowed token %d\n", __func__, id);
+                continue;
+            }
+            allowed.push_back(id);
+        }
+
+        allowed.push_back(vocab.token_eot);
+
+        if (params.tdrz_enable) {
+            allowed.push_back(vocab.token_solm);
+        }
+
+        if (!params.no_timestamps) {
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                allowed.push_back(i);
+            }
+        }
+
+        std::sort(allowed.begin(), allowed.end());
+        allowed.erase(std::unique(allowed.begin(), allowed.end()), allowed.end());
+    }
+
+    if ((int) sup.bias_pre.size() == n_logits &&
+        sup.suppress_regex == suppress_regex  &&
+        sup.suppress_nst   == params.suppress_nst &&
+        sup.no_timestamps  == params.no_timestamps &&
+        sup.tdrz_enable    == params.tdrz_enable &&
+        sup.allowed        == allowed) {
+        return;
+    }
+
+    sup.suppress_regex = suppress_regex;
+    sup.suppress_nst   = params.suppress_nst;
+    sup.no_timestamps  = params.no_timestamps;
+    sup.tdrz_enable    = params.tdrz_enable;
+    sup.allowed        = std::move(allowed);
+
+    sup.bias_pre .assign(n_logits, sup.allowed.empty() ? 0.0f : -INFINITY);
+    sup.bias_post.assign(n_logits, 0.0f);
+
+    for (const whisper_token id : sup.allowed) {
+        sup.bias_pre[id] = 0.0f;
+    }
+
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        auto & bias = sup.bias_pre;
+
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        bias[vocab.token_not] = -INFINITY;
+        if (params.no_timestamps) {
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                bias[i] = -INFINITY;
+            }
+        }
+
+        // suppress sot and nosp tokens
+        bias[vocab.token_sot]  = -INFINITY;
+        bias[vocab.token_nosp] = -INFINITY;
+
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            bias[vocab.token_solm] = -INFINITY;
+        }
+
+        // suppress task tokens
+        bias[vocab.token_translate]  = -INFINITY;
+        bias[vocab.token_transcribe] = -INFINITY;
+        bias[vocab.token_prev]       = -INFINITY;
+
+        // suppress lang tokens
+        for (size_t i = 0; i < g_lang.size(); ++i) {
+            bias[whisper_token_lang(&ctx, i)] = -INFINITY;
+        }
+    }
+
+    {
+        auto & bias = sup.bias_post;
+
+        // suppress any tokens matching a regular expression
+        // ref: https://github.com/openai/whisper/discussions/1041
+        if (params.suppress_regex != nullptr) {
+            std::regex re(params.suppress_regex);
+            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
+                if (std::regex_match(token_id.first, re)) {
+                    bias[token_id.second] = -INFINITY;
+                }
+            }
+        }
+
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        if (params.suppress_nst) {
+            for (const std::string & token : non_speech_tokens) {
+                const std::string suppress_tokens[] = {token, " " + token};
+                for (const std::string & suppress_token : suppress_tokens) {
+                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                        bias[vocab.token_to_id.at(suppress_token)] = -INFINITY;
+                    }
+                }
+            }
+
+            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+                bias[vocab.token_to_id.at(" -")] = -INFINITY;
+            }
+            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+                bias[vocab.token_to_id.at(" '")] = -INFINITY;
+            }
+        }
     }
-
-    return result;
 }
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
-
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
-
-    return txt[0] == ' ';
+// logits[i] += bias[i] - a bias of 0 leaves the logit unchanged, -INFINITY suppresses the token
+static void whisper_logits_add_bias(float * logits, const float * bias, int n) {
+    for (int i = 0; i < n; ++i) {
+        logits[i] += bias[i];
+    }
 }
 
-static void whisper_exp_compute_token_level_timestamps_dtw(
-            struct whisper_context * ctx,
-              struct whisper_state * state,
-        struct whisper_full_params   params,
-                               int   i_segment,
-                            size_t   n_segments,
-                               int   seek,
-                               int   n_frames,
-                               int   medfilt_width,
-                               int   n_threads);
+// [EXPERIMENTAL] greedy_on_device - upload the static suppression built by whisper_logits_suppress_init()
+static bool whisper_logits_reduce_init(
+              struct whisper_context & ctx,
+                struct whisper_state & state) {
+    const auto & suppress = state.logits_suppress;
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+    auto & reduce = state.logits_reduce;
 
-    int res = 1;
-    int acc = 0;
+    const int n_logits = ctx.vocab.n_vocab;
 
-    std::string text;
+    if (!reduce.buffer) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
+        reduce.ctx = ggml_init(params);
+        if (!reduce.ctx) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the logits bias context\n", __func__);
+            return false;
         }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+        reduce.bias = ggml_new_tensor_1d(reduce.ctx, GGML_TYPE_F32, n_logits);
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+        reduce.buffer = ggml_backend_alloc_ctx_tensors(reduce.ctx, state.backends[0]);
+        if (!reduce.buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the logits bias\n", __func__);
+            ggml_free(reduce.ctx);
+            reduce.ctx  = nullptr;
+            reduce.bias = nullptr;
+            return false;
+        }
+    }
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    std::vector<float> bias(suppress.bias_pre);
+    whisper_logits_add_bias(bias.data(), suppress.bias_post.data(), n_logits);
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+    ggml_backend_tensor_set(reduce.bias, bias.data(), 0, ggml_nbytes(reduce.bias));
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+    return true;
+}
 
-            acc = 0;
-            text = "";
+// [EXPERIMENTAL] restricted vocabulary - upload the allowed tokens built by whisper_logits_suppress_init()
+static bool whisper_logits_restrict_init(struct whisper_state & state) {
+    const auto & allowed = state.logits_suppress.allowed;
 
-            segment = state.result_all.back();
-            i = -1;
+    auto & lr = state.logits_restrict;
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
-        }
+    if (lr.ids && ggml_nelements(lr.ids) != (int64_t) allowed.size()) {
+        ggml_free(lr.ctx);
+        ggml_backend_buffer_free(lr.buffer);
+
+        lr.ids    = nullptr;
+        lr.ctx    = nullptr;
+        lr.buffer = nullptr;
     }
 
-    state.result_all.back().text = std::move(text);
+    if (!lr.ids) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
 
-    return res;
-}
+        lr.ctx = ggml_init(params);
+        if (!lr.ctx) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the allowed tokens context\n", __func__);
+            return false;
+        }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+        lr.ids = ggml_new_tensor_1d(lr.ctx, GGML_TYPE_I32, allowed.size());
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
+        lr.buffer = ggml_backend_alloc_ctx_tensors(lr.ctx, state.backends[0]);
+        if (!lr.buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the allowed tokens\n", __func__);
+            ggml_free(lr.ctx);
+            lr.ctx = nullptr;
+            lr.ids = nullptr;
+            return false;
         }
     }
-    logsumexp = logf(logsumexp) + logit_max;
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
-    }
-}
+    ggml_backend_tensor_set(lr.ids, allowed.data(), 0, ggml_nbytes(lr.ids));
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
-        }
-    }
+    return true;
 }
 
 // process the logits for the selected decoder
@@ -6168,6 +8922,8 @@ static void whisper_process_logits(
         // will be populated a bit later
         probs.resize(n_logits);
         logprobs.resize(n_logits);
+
+        decoder.reduced = false;
     }
 
     // apply logit filters here
@@ -6182,72 +8938,20 @@ static void whisper_process_logits(
             }
         }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
-
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
-        }
-
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
+        // suppress the special tokens: <|notimestamps|>, sot, nosp, solm, task, lang and prev (+ all timestamps with no_timestamps)
+        // the suppression is built by whisper_logits_suppress_init()
+        const auto & suppress = state.logits_suppress;
 
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
+        WHISPER_ASSERT((int) suppress.bias_pre.size() == n_logits);
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
+        whisper_logits_add_bias(logits.data(), suppress.bias_pre.data(), n_logits);
 
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
-        }
+        // suppress the tokens matching suppress_regex and the non-speech tokens (suppress_nst)
+        whisper_logits_add_bias(logits.data(), suppress.bias_post.data(), n_logits);
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
         // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
@@ -6298,21 +9002,9 @@ static void whisper_process_logits(
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
             // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+            const float timestamp_logprob = whisper_vec_logsumexp_f32(n_logits - vocab.token_beg, logprobs.data() + vocab.token_beg, probs.data() + vocab.token_beg);
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float max_text_token_logprob = whisper_vec_max_f32(vocab.token_beg, logprobs.data());
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
@@ -6326,31 +9018,14 @@ static void whisper_process_logits(
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
                     // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    whisper_compute_logprobs(logits, n_logits, logprobs);
                 }
             }
         }
     }
 
     // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+    whisper_compute_probs(n_logits, logprobs, probs);
 
 #if 0
     // print first 100 logits - token string : logit
@@ -6419,6 +9094,106 @@ static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whis
     return true;
 }
 
+// [EXPERIMENTAL] greedy_on_device - whisper_process_logits() for a decode with the logits reduced in the graph
+// the static suppression is already applied and the text tokens [0, token_eot) are known only by their argmax, max and
+// logsumexp - this is enough for the remaining filters, since they suppress either all of the text tokens or none
+static void whisper_process_logits_reduced(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+              struct whisper_decoder & decoder) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+    const auto & reduce     = state.logits_reduce;
+
+    const int n_logits = vocab.n_vocab;
+    const int i0       = vocab.token_eot;
+    const int n_tail   = n_logits - i0;
+
+    // the initial token is processed by whisper_process_logits()
+    WHISPER_ASSERT(!tokens_cur.empty());
+    WHISPER_ASSERT((int) reduce.tail.size() == n_tail);
+
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+
+    logits.resize(n_logits);
+    probs.resize(n_logits);
+    logprobs.resize(n_logits);
+
+    memcpy(logits.data() + i0, reduce.tail.data(), n_tail*sizeof(float));
+
+    bool text_suppressed = false;
+
+    // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+    {
+        const bool last_was_timestamp        = tokens_cur.back().id >= vocab.token_beg;
+        const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+        if (last_was_timestamp) {
+            if (penultimate_was_timestamp) {
+                for (int i = vocab.token_beg; i < n_logits; ++i) {
+                    logits[i] = -INFINITY;
+                }
+            } else {
+                text_suppressed = true;
+            }
+        }
+    }
+
+    // condition timestamp tokens to be increasing
+    if (decoder.has_ts) {
+        const int tid0 = decoder.seek_delta/2;
+
+        for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
+            logits[i] = -INFINITY;
+        }
+    }
+
+    // log_softmax over the text tokens and the tail
+    float text_logprob = -INFINITY;
+    {
+        const float lse_text = text_suppressed ? -INFINITY : reduce.text_lse;
+        const float lse_tail = whisper_vec_logsumexp_f32(n_tail, logits.data() + i0, probs.data() + i0);
+
+        const float lse_max = std::max(lse_text, lse_tail);
+        const float lse     = lse_max == -INFINITY ? -INFINITY : lse_max + logf(expf(lse_text - lse_max) + expf(lse_tail - lse_max));
+
+        if (lse == -INFINITY) {
+            std::fill(logprobs.begin() + i0, logprobs.end(), -INFINITY);
+        } else {
+            for (int i = i0; i < n_logits; ++i) {
+                logprobs[i] = logits[i] - lse;
+            }
+
+            if (!text_suppressed) {
+                text_logprob = reduce.text_max - lse;
+            }
+        }
+    }
+
+    // if sum of probability over timestamps is above any other token, sample timestamp
+    {
+        const float timestamp_logprob = whisper_vec_logsumexp_f32(n_logits - vocab.token_beg, logprobs.data() + vocab.token_beg, probs.data() + vocab.token_beg);
+
+        const float max_text_token_logprob = std::max(text_logprob, whisper_vec_max_f32(vocab.token_beg - i0, logprobs.data() + i0));
+
+        if (timestamp_logprob > max_text_token_logprob) {
+            text_logprob = -INFINITY;
+            for (int i = i0; i < vocab.token_beg; ++i) {
+                logits[i]   = -INFINITY;
+                logprobs[i] = -INFINITY;
+            }
+        }
+    }
+
+    whisper_vec_exp_f32(n_tail, probs.data() + i0, logprobs.data() + i0);
+
+    decoder.reduced              = true;
+    decoder.reduced_text_id      = reduce.text_id;
+    decoder.reduced_text_logprob = text_logprob;
+}
+
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
       const whisper_decoder & decoder,
@@ -6455,7 +9230,21 @@ static whisper_token_data whisper_sample_token(
     }
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
+        int i0 = 0;
+
+        // [EXPERIMENTAL] greedy_on_device - the text tokens are represented by their argmax
+        if (decoder.reduced) {
+            const float p = expf(decoder.reduced_text_logprob);
+            if (result.p < p) {
+                result.id   = decoder.reduced_text_id;
+                result.p    = p;
+                result.plog = decoder.reduced_text_logprob;
+            }
+
+            i0 = vocab.token_eot;
+        }
+
+        for (int i = i0; i < n_logits; ++i) {
             if (result.p < probs[i]) {
                 result.id   = i;
                 result.p    = probs[i];
@@ -6463,6 +9252,8 @@ static whisper_token_data whisper_sample_token(
             }
         }
     } else {
+        WHISPER_ASSERT(!decoder.reduced);
+
         std::discrete_distribution<> dist(probs.begin(), probs.end());
 
         result.id   = dist(decoder.rng);
@@ -6550,10 +9341,55 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         }
     }
 
-    return result;
+    return result;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static double whisper_length_penalty(const struct whisper_full_params & params, int len) {
+    double penalty = len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    return penalty;
+}
+
+// check if the sequence ends with at least n_tokens tokens that repeat the same n-gram of up to ngram_max tokens
+// timestamp tokens are treated as equal, since they keep increasing while the text loops
+static bool whisper_sequence_is_loop(
+        const struct whisper_context & ctx,
+        const whisper_sequence & sequence,
+                           int   ngram_max,
+                           int   n_tokens) {
+    const auto & tokens = sequence.tokens;
+
+    const int n = tokens.size();
+
+    if (n < n_tokens) {
+        return false;
+    }
+
+    const whisper_token token_beg = ctx.vocab.token_beg;
+
+    auto id = [&](int i) {
+        return std::min(tokens[i].id, token_beg);
+    };
+
+    for (int p = 1; p <= ngram_max && p < n_tokens; ++p) {
+        int k = 0;
+        while (k < n_tokens - p && id(n - 1 - k) == id(n - 1 - k - p)) {
+            ++k;
+        }
+
+        if (k == n_tokens - p) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
 static void whisper_sequence_score(
         const struct whisper_full_params & params,
                         whisper_sequence & sequence) {
@@ -6570,13 +9406,7 @@ static void whisper_sequence_score(
     sequence.sum_logprobs = result;
     sequence.avg_logprobs = result/sequence.result_len;
 
-    double penalty = sequence.result_len;
-
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
-    }
-
-    sequence.score = result/penalty;
+    sequence.score = result/whisper_length_penalty(params, sequence.result_len);
 
     // compute the entropy of the sequence of the last 32 tokens
     {
@@ -6713,12 +9543,181 @@ static bool whisper_vad(
     return true;
 }
 
-int whisper_full_with_state(
+// [EXPERIMENTAL] speculative decoding
+//
+// a smaller model with the same vocabulary proposes a few tokens with greedy sampling and the main model evaluates
+// all of them in a single batch. the tokens are still sampled from the logits of the main model, so a draft token is
+// used only if the main model would have sampled it anyway - the KV cache of the rejected tokens is removed with
+// whisper_kv_cache_seq_rm()
+
+static bool whisper_draft_init(whisper_context & ctx, whisper_state & state, whisper_context & dctx) {
+    const auto & hparams  = ctx.model.hparams;
+    const auto & dhparams = dctx.model.hparams;
+
+    if (dctx.vocab.n_vocab != ctx.vocab.n_vocab || dhparams.n_mels != hparams.n_mels || dhparams.n_audio_ctx != hparams.n_audio_ctx) {
+        WHISPER_LOG_WARN("%s: the draft model does not match the model (n_vocab = %d / %d, n_mels = %d / %d, n_audio_ctx = %d / %d) - speculative decoding is disabled\n",
+                __func__, dctx.vocab.n_vocab, ctx.vocab.n_vocab, dhparams.n_mels, hparams.n_mels, dhparams.n_audio_ctx, hparams.n_audio_ctx);
+        return false;
+    }
+
+    if (state.draft_ctx != &dctx) {
+        whisper_free_state(state.draft_state);
+
+        state.draft_ctx   = nullptr;
+        state.draft_state = whisper_init_state(&dctx);
+
+        if (state.draft_state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to create the state of the draft model\n", __func__);
+            return false;
+        }
+
+        state.draft_ctx = &dctx;
+    }
+
+    state.draft_past.clear();
+
+    return true;
+}
+
+// encode the window of the mel spectrogram at seek with the draft model
+static bool whisper_draft_encode(
+        whisper_context & ctx,
+          whisper_state & state,
+                    int   seek,
+                    int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & dstate = *state.draft_state;
+
+    const auto & mel  = state.mel;
+          auto & dmel = dstate.mel;
+
+    // copy the frames of the window - the spectrogram has already been computed for the main model
+    const int n_ctx = state.exp_n_audio_ctx > 0 ? state.exp_n_audio_ctx : ctx.model.hparams.n_audio_ctx;
+
+    // the windowed mel can hold another window, e.g. after the batched encoder
+    if (!whisper_mel_update_window(ctx, state, seek, n_ctx)) {
+        return false;
+    }
+
+    const int i0 = std::max(std::min(seek,           mel.n_len), mel.offset);
+    const int i1 = std::min(std::min(seek + 2*n_ctx, mel.n_len), mel.offset + mel.n_frames);
+
+    dmel.n_len     = mel.n_len;
+    dmel.n_len_org = mel.n_len_org;
+    dmel.n_mel     = mel.n_mel;
+    dmel.offset    = i0;
+    dmel.n_frames  = std::max(0, i1 - i0);
+    dmel.data.resize(dmel.n_mel*dmel.n_frames);
+
+    for (int j = 0; j < dmel.n_mel; ++j) {
+        memcpy(dmel.data.data() + j*dmel.n_frames, mel.data.data() + j*mel.n_frames + (i0 - mel.offset), dmel.n_frames*sizeof(float));
+    }
+
+    dstate.exp_n_audio_ctx = state.exp_n_audio_ctx;
+
+    const bool ok = whisper_encode_internal(*state.draft_ctx, dstate, seek, n_threads, abort_callback, abort_callback_data);
+
+    // the self-attention KV cache depends on the audio through the cross-attention
+    whisper_kv_cache_clear(dstate.kv_self);
+    state.draft_past.clear();
+
+    state.t_draft_us += ggml_time_us() - t_start_us;
+
+    return ok;
+}
+
+// propose up to n_draft tokens that follow the prompt and the tokens of the decoder
+// the proposal ends before the first EOT token
+static bool whisper_draft_propose(
+                   whisper_state & state,
+const std::vector<whisper_token> & prompt,
+           const whisper_decoder & decoder,
+       const whisper_full_params & params,
+                             int   n_draft,
+      std::vector<whisper_token> & result) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & dctx   = *state.draft_ctx;
+    auto & dstate = *state.draft_state;
+    auto & past   = state.draft_past;
+    auto & batch  = dstate.batch;
+
+    result.clear();
+
+    std::vector<whisper_token> seq(prompt);
+    for (const auto & token : decoder.sequence.tokens) {
+        seq.push_back(token.id);
+    }
+
+    // keep the part of the draft KV cache that matches the sequence - the last token is always evaluated again
+    int n_keep = 0;
+    while (n_keep < (int) past.size() && n_keep + 1 < (int) seq.size() && past[n_keep] == seq[n_keep]) {
+        ++n_keep;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_keep, -1);
+    past.resize(n_keep);
+
+    whisper_batch_prep_legacy(batch, seq.data() + n_keep, seq.size() - n_keep, n_keep, 0);
+
+    auto & ddecoder = dstate.decoders[0];
+
+    ddecoder.sequence.tokens = decoder.sequence.tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
+    ddecoder.grammar         = {};
+
+    const whisper_token token_eot = whisper_token_eot(&dctx);
+    const whisper_token token_beg = whisper_token_beg(&dctx);
+
+    bool ok = true;
+
+    for (int i = 0; i < n_draft; ++i) {
+        if (!whisper_decode_internal(dctx, dstate, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+            ok = false;
+            break;
+        }
+
+        past.insert(past.end(), batch.token, batch.token + batch.n_tokens);
+
+        ddecoder.i_batch = batch.n_tokens - 1;
+
+        whisper_process_logits(dctx, dstate, ddecoder, params, 0.0f);
+
+        const auto token = whisper_sample_token(dctx, ddecoder, true);
+        if (token.id == token_eot) {
+            break;
+        }
+
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (token.id > token_beg) {
+            ddecoder.seek_delta = 2*(token.id - token_beg);
+            ddecoder.has_ts     = true;
+        }
+
+        result.push_back(token.id);
+
+        whisper_batch_prep_legacy(batch, &token.id, 1, past.size(), 0);
+    }
+
+    state.n_draft    += result.size();
+    state.t_draft_us += ggml_time_us() - t_start_us;
+
+    return ok;
+}
+
+// the input audio is either the samples or, if not null, the source
+static int whisper_full_internal(
         struct whisper_context * ctx,
           struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
-                           int   n_samples) {
+                           int   n_samples,
+    const whisper_audio_source * source) {
     // clear old results
     auto & result_all = state->result_all;
 
@@ -6728,6 +9727,11 @@ int whisper_full_with_state(
     int n_process_samples = n_samples;
     std::vector<float> vad_samples;
 
+    if (source && params.vad) {
+        WHISPER_LOG_ERROR("%s: VAD is not supported with an audio source\n", __func__);
+        return -1;
+    }
+
     if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
         int vad_n_samples;
@@ -6739,14 +9743,40 @@ int whisper_full_with_state(
         n_process_samples = vad_n_samples;
     }
 
-    if (n_process_samples > 0) {
-        // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, process_samples, n_process_samples, params.n_threads) != 0) {
+    // the windowed mel refers to the input samples, so it must not outlive this call
+    struct mel_source_guard {
+        whisper_state * state;
+        ~mel_source_guard() {
+            state->mel_src = {};
+        }
+    } mel_guard = { state };
+
+    if (source) {
+        // pull the samples of the first window - the rest is read as the transcription progresses
+        whisper_mel_init_source(*state, *source, ctx->model.filters.n_mel, params.n_threads, params.token_timestamps);
+
+        const int n_ctx = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+
+        if (!whisper_mel_source_fill(*state, 0, 2*n_ctx)) {
+            WHISPER_LOG_ERROR("%s: failed to read the audio source\n", __func__);
+            return -2;
+        }
+    } else if (n_process_samples > 0) {
+        if (params.mel_window) {
+            // compute the log mel spectrogram on demand, one window at a time
+            whisper_mel_init_window(*state, process_samples, n_process_samples, ctx->model.filters.n_mel, params.n_threads);
+        } else if (whisper_pcm_to_mel_with_state(ctx, state, process_samples, n_process_samples, params.n_threads) != 0) {
+            // compute log mel spectrogram
             WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
             return -2;
         }
     }
 
+    // the window that the current encoder output (embd_enc and the cross-attention KV cache) belongs to
+    // allows to skip the encoder when the same window is processed again, e.g. after the language detection
+    int seek_encoded  = -1;
+    int n_ctx_encoded = -1;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
@@ -6756,6 +9786,9 @@ int whisper_full_with_state(
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
         }
+
+        seek_encoded  = 0;
+        n_ctx_encoded = state->exp_n_audio_ctx;
         state->lang_id = lang_id;
         params.language = whisper_lang_str(lang_id);
 
@@ -6771,11 +9804,12 @@ int whisper_full_with_state(
         state->tid_last = 0;
         if (n_samples > 0) {
             state->energy = get_signal_energy(samples, n_samples, 32);
+            state->energy_offset = 0;
         }
     }
 
     const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+    int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
 
     // if length of spectrogram is less than 100ms (10 frames), then return
     // basically don't process anything that is less than 100ms
@@ -6833,6 +9867,25 @@ int whisper_full_with_state(
         decoder.rng = std::mt19937(j);
     }
 
+    // recreate the KV cache if it is too small for the number of decoders - it is sized for the worst case, so this
+    // happens at most once per state and decoder count
+    if (state->kv_self_n_dec < n_decoders) {
+        WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders = %d\n", __func__, n_decoders);
+
+        whisper_kv_cache_free(state->kv_self);
+
+        if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    ctx->model.hparams.n_text_state,
+                    ctx->model.hparams.n_text_layer,
+                    whisper_kv_self_n_ctx(*ctx, n_decoders))) {
+            WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+            whisper_free_state(state);
+            return -7;
+        }
+
+        state->kv_self_n_dec = n_decoders;
+    }
+
     // the accumulated text context so far
     auto & prompt_past = state->prompt_past;
     if (params.no_context) {
@@ -6905,21 +9958,132 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // the last decoded prompt - while the encoder output does not change, its KV cache and logits can be reused
+    // note: the prompt KV depends on the audio through the cross-attention, so this works only within a window
+    std::vector<whisper_token> prompt_cached;
+    std::vector<float>         prompt_cached_logits;
+    float                      prompt_cached_no_speech_prob = 0.0f;
+
+    // a beam candidate is the sequence of decoder_idx followed by token - the sequences and the grammars are copied
+    // only for the selected candidates
     struct beam_candidate {
         int decoder_idx;
-        int seek_delta;
 
-        bool has_ts;
+        whisper_token_data token;
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+        double   sum_logprobs_all;
+        uint64_t hash; // hash of the token ids of the candidate sequence
     };
 
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // the sequences and grammars of the decoders before the beam search step - reused to avoid memory allocations
+    std::vector<whisper_sequence> beam_sequences(n_decoders);
+    std::vector<whisper_grammar>  beam_grammars (n_decoders);
+
+    // [beam search] patience - the finished sequences are collected here and a beam that finishes continues with the
+    // next best candidate, until round(patience*beam_size) sequences have finished
+    // ref: https://arxiv.org/pdf/2204.05424.pdf
+    struct beam_finished {
+        whisper_sequence sequence;
+
+        int  seek_delta;
+        bool has_ts;
+    };
+
+    const bool beam_patience = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH && params.beam_search.patience > 0.0f;
+
+    std::vector<beam_finished> beam_finished_all;
+
+    // [EXPERIMENTAL] batched encoder - the audio is transcribed in fixed-stride windows and the next encode_batch windows
+    // are encoded at once. not supported with an audio source, which is read as the transcription progresses
+    const int seek_stride = 2*(state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx);
+
+    const bool encode_batch =
+        params.encode_batch > 1 &&
+        source == nullptr &&
+        !whisper_encode_external(*state) &&
+        whisper_encode_ahead_init(*ctx, *state, params.encode_batch - 1);
+
+    // set the result length of a sequence that ends the segment at step i
+    // returns false if the segment has no result
+    const auto finish_segment = [&](whisper_sequence & sequence, int & seek_delta, int i) {
+        auto & result_len = sequence.result_len;
+
+        if (result_len == 0 && !params.no_timestamps) {
+            if (seek + seek_delta + delta_min >= seek_end) {
+                result_len = i + 1;
+            } else {
+                return false;
+            }
+        }
+
+        if (params.single_segment || params.no_timestamps || encode_batch) {
+            result_len = i + 1;
+            seek_delta = encode_batch ? seek_stride : 100*WHISPER_CHUNK_SIZE;
+        }
+
+        return true;
+    };
+
+    // the static part of the logits suppression - kept in the state, so it is rebuilt only when the params change
+    whisper_logits_suppress_init(*ctx, params, state->logits_suppress);
+
+    // [EXPERIMENTAL] greedy_on_device - not compatible with logits that are modified or sampled outside of the static
+    // suppression and the timestamp rules
+    const bool reduce_logits =
+        params.greedy_on_device &&
+        params.strategy == WHISPER_SAMPLING_GREEDY &&
+        params.n_grammar_rules == 0 &&
+        params.logits_filter_callback == nullptr &&
+        state->logits_suppress.allowed.empty() &&
+        whisper_logits_reduce_init(*ctx, *state);
+
+    // [EXPERIMENTAL] restricted vocabulary - without it, the suppression of the tokens that are not allowed is still
+    // applied by the bias
+    const bool restrict_logits =
+        !state->logits_suppress.allowed.empty() &&
+        whisper_logits_restrict_init(*state);
+
+    // [EXPERIMENTAL] speculative decoding - greedy at t == 0 with the logits processed only by whisper_process_logits()
+    const bool draft =
+        params.draft_ctx != nullptr &&
+        params.draft_n_tokens > 0 &&
+        params.strategy == WHISPER_SAMPLING_GREEDY &&
+        params.n_grammar_rules == 0 &&
+        params.logits_filter_callback == nullptr &&
+        state->batch_sched == nullptr &&
+        whisper_draft_init(*ctx, *state, *params.draft_ctx);
+
+    if (draft) {
+        whisper_logits_suppress_init(*params.draft_ctx, params, state->draft_state->logits_suppress);
+    }
+
+    // the window that the encoder output of the draft model belongs to
+    int seek_draft  = -1;
+    int n_ctx_draft = -1;
+
+    // the draft tokens that have been evaluated by the last decoder pass, and the next one to verify
+    std::vector<whisper_token> draft_tokens;
+    int                        draft_next = 0;
+
     // main loop
     while (true) {
+        if (source) {
+            const int n_ctx = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+
+            // read a bit past the end of the window, so that the end of the audio is known when the window reaches it
+            if (!whisper_mel_source_fill(*state, seek, 2*n_ctx + delta_min)) {
+                WHISPER_LOG_ERROR("%s: failed to read the audio source\n", __func__);
+                return -2;
+            }
+
+            if (params.duration_ms == 0) {
+                seek_end = whisper_n_len_from_state(state);
+            }
+        }
+
         if (params.progress_callback) {
             const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
 
@@ -6940,9 +10104,65 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-            return -6;
+        if (seek == seek_encoded && state->exp_n_audio_ctx == n_ctx_encoded) {
+            WHISPER_LOG_DEBUG("%s: reusing the encoder output for seek = %d\n", __func__, seek);
+        } else {
+            // [EXPERIMENTAL] batched encoder - the window can have been encoded ahead
+            const auto it_ahead = std::find(state->seek_ahead.begin(), state->seek_ahead.end(), seek);
+
+            // the windows to encode together with the current one
+            int n_ahead = 0;
+            if (encode_batch && it_ahead == state->seek_ahead.end()) {
+                while (n_ahead < params.encode_batch - 1 && seek + (n_ahead + 1)*seek_stride + delta_min < seek_end) {
+                    n_ahead++;
+                }
+            }
+
+            if (encode_batch && it_ahead != state->seek_ahead.end()) {
+                WHISPER_LOG_DEBUG("%s: using the batched encoder output for seek = %d\n", __func__, seek);
+
+                const int i = it_ahead - state->seek_ahead.begin();
+
+                std::swap(state->kv_cross, state->kv_cross_ahead[i]);
+                state->seek_ahead[i] = -1;
+            } else if (n_ahead > 0) {
+                std::vector<whisper_encode_window> windows = { { state, seek, &state->kv_cross, &state->kv_pad } };
+
+                std::fill(state->seek_ahead.begin(), state->seek_ahead.end(), -1);
+
+                for (int i = 0; i < n_ahead; ++i) {
+                    windows.push_back({ state, seek + (i + 1)*seek_stride, &state->kv_cross_ahead[i], &state->kv_pad_ahead[i] });
+                }
+
+                if (!whisper_encode_batch_internal(*ctx, windows, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                    WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+                    return -6;
+                }
+
+                for (int i = 0; i < n_ahead; ++i) {
+                    state->seek_ahead[i] = windows[i + 1].mel_offset;
+                }
+            } else {
+                if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                    WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+                    return -6;
+                }
+            }
+
+            prompt_cached.clear();
+        }
+
+        seek_encoded  = seek;
+        n_ctx_encoded = state->exp_n_audio_ctx;
+
+        if (draft && (seek != seek_draft || state->exp_n_audio_ctx != n_ctx_draft)) {
+            if (!whisper_draft_encode(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                return -6;
+            }
+
+            seek_draft  = seek;
+            n_ctx_draft = state->exp_n_audio_ctx;
         }
 
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
@@ -6979,6 +10199,18 @@ int whisper_full_with_state(
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
+            const bool speculative = draft && t_cur < 1e-6f;
+
+            draft_tokens.clear();
+            draft_next = 0;
+
+            // [beam search] patience - the finished decoders that take the next best candidate in the next step
+            bool beam_refill[WHISPER_MAX_DECODERS] = {};
+
+            const int n_finish = std::max(1, (int) std::round(params.beam_search.patience*n_decoders_cur));
+
+            beam_finished_all.clear();
+
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
@@ -6990,6 +10222,7 @@ int whisper_full_with_state(
                 decoder.sequence.avg_logprobs     = -INFINITY;
                 decoder.sequence.entropy          = 0.0;
                 decoder.sequence.score            = -INFINITY;
+                decoder.sequence.hash             = WHISPER_SEQUENCE_HASH_INIT;
 
                 decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
 
@@ -7005,7 +10238,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -7027,53 +10259,55 @@ int whisper_full_with_state(
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
-                // recreate the KV cache if the number of decoders has changed
-                if (state->kv_self_n_dec < n_decoders_cur) {
-                    WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
+                const int n_logits = ctx->vocab.id_to_token.size();
 
-                    whisper_kv_cache_free(state->kv_self);
+                if (!prompt_cached.empty() && prompt == prompt_cached) {
+                    // same prompt and audio as the previous iteration (e.g. a temperature fallback) - keep the prompt
+                    // in the KV cache of the first decoder and drop the generated tokens of all decoders
+                    WHISPER_LOG_DEBUG("%s: reusing the KV cache of the prompt (%d tokens)\n", __func__, (int) prompt.size());
 
-                    // overallocate to workaround KV cache fragmentation issues
-                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
+                    whisper_kv_cache_seq_rm  (state->kv_self, 0, prompt.size(), -1);
+                    whisper_kv_cache_seq_keep(state->kv_self, 0);
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
-                                ctx->model.hparams.n_text_state,
-                                ctx->model.hparams.n_text_layer,
-                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
-                        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-                        whisper_free_state(state);
-                        return -7;
-                    }
+                    state->logits         = prompt_cached_logits;
+                    state->no_speech_prob = prompt_cached_no_speech_prob;
 
-                    state->kv_self_n_dec = n_decoders_cur;
-                }
+                    state->decoders[0].i_batch = 0;
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
 
-                whisper_kv_cache_clear(state->kv_self);
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    // the prompt is decoded over the full vocabulary, even with a restricted vocabulary, since the
+                    // no_speech_prob has to be normalized over all tokens - the bias suppresses the other tokens
+                    const bool ok = whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
-                }
+                    if (!ok) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
 
-                // Calculate no_speech probability after first decode.
-                // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
-                {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+                    // Calculate no_speech probability after first decode.
+                    // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
+                    {
+                        std::vector<float> logprobs(n_logits);
+                        std::vector<float> probs(n_logits);
+
+                        whisper_compute_logprobs(state->logits, n_logits, logprobs);
+                        whisper_compute_probs(n_logits, logprobs, probs);
+                        state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    }
+
+                    state->decoders[0].i_batch = prompt.size() - 1;
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    prompt_cached = prompt;
+                    prompt_cached_logits.assign(state->logits.begin() + (prompt.size() - 1)*n_logits, state->logits.begin() + prompt.size()*n_logits);
+                    prompt_cached_no_speech_prob = state->no_speech_prob;
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
-
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
@@ -7100,7 +10334,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
                     std::atomic<int> j_cur(0);
 
@@ -7134,32 +10368,18 @@ int whisper_full_with_state(
                                         const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
                                         for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                            bc_per_dec[j].push_back({
+                                                j, token,
+                                                decoder.sequence.sum_logprobs_all + token.plog,
+                                                whisper_sequence_hash_add(decoder.sequence.hash, token.id),
+                                            });
                                         }
                                     } break;
                             };
                         }
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    state->pool.run(std::min(params.n_threads, n_decoders_cur), [&](int) { process(); });
                 }
 
                 beam_candidates.clear();
@@ -7173,56 +10393,163 @@ int whisper_full_with_state(
 
                 // for beam-search, choose the top candidates and update the KV caches
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                    const auto cmp = [](const beam_candidate & a, const beam_candidate & b) {
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
-                    });
+                    };
+
+                    int n_active = 0;
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if ((!state->decoders[j].completed || beam_refill[j]) && !state->decoders[j].failed) {
+                            n_active++;
+                        }
+                    }
+
+                    // only the top candidates are needed - the rest is sorted only if the duplicates exhaust them
+                    size_t n_sorted = std::min(beam_candidates.size(), (size_t) n_active);
+
+                    std::partial_sort(beam_candidates.begin(), beam_candidates.begin() + n_sorted, beam_candidates.end(), cmp);
+
+                    const auto candidate = [&](size_t c) {
+                        if (c >= n_sorted) {
+                            std::sort(beam_candidates.begin() + n_sorted, beam_candidates.end(), cmp);
+                            n_sorted = beam_candidates.size();
+                        }
+                        return beam_candidates[c];
+                    };
+
+                    const auto candidates_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+                        return a.hash == b.hash && a.token.id == b.token.id && (a.decoder_idx == b.decoder_idx ||
+                                whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
+                    };
 
                     uint32_t cur_c = 0;
 
+                    // the selected candidate of each decoder and the KV cache sequence that it continues
+                    // the finished decoders keep their own
+                    beam_candidate beam_selected[WHISPER_MAX_DECODERS];
+                    whisper_seq_id seq_src[WHISPER_MAX_DECODERS];
+                    bool           seq_fork = false;
+
+                    // the last candidate that finished a sequence
+                    beam_candidate eot_prev = { -1, {}, 0.0, 0 };
+
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
 
-                        if (decoder.completed || decoder.failed) {
+                        seq_src[j] = j;
+
+                        if ((decoder.completed && !beam_refill[j]) || decoder.failed) {
                             continue;
                         }
 
+                        // [beam search] patience - the candidates that end the text are finished sequences and do not
+                        // take a beam, so that the beams continue with the next best candidates
+                        if (beam_patience) {
+                            while (cur_c < beam_candidates.size() && candidate(cur_c).token.id == whisper_token_eot(ctx)) {
+                                const auto cand = candidate(cur_c++);
+                                const auto & src = state->decoders[cand.decoder_idx];
+
+                                // the top-k sampling can return the same candidate more than once
+                                if ((int) beam_finished_all.size() >= n_finish || (eot_prev.decoder_idx >= 0 && candidates_equal(eot_prev, cand))) {
+                                    continue;
+                                }
+
+                                eot_prev = cand;
+
+                                beam_finished f = { src.sequence, src.seek_delta, src.has_ts };
+
+                                f.sequence.tokens.push_back(cand.token);
+                                f.sequence.sum_logprobs_all = cand.sum_logprobs_all;
+                                f.sequence.hash             = cand.hash;
+
+                                if (finish_segment(f.sequence, f.seek_delta, i)) {
+                                    beam_finished_all.push_back(std::move(f));
+                                }
+                            }
+
+                            if (cur_c >= beam_candidates.size()) {
+                                // no candidates left for this beam
+                                if (!decoder.completed) {
+                                    state->decoders[j].failed = true;
+                                }
+                                continue;
+                            }
+                        }
+
                         if (cur_c >= beam_candidates.size()) {
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        const auto cur = candidate(cur_c++);
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && i > 0 && candidates_equal(candidate(cur_c), cur)) {
                             ++cur_c;
                         }
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+                        beam_selected[j] = cur;
 
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                        seq_src[j] = cur.decoder_idx;
+                        seq_fork   = true;
+                    }
 
-                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    // save the sequences that continue in another decoder before any of them is modified
+                    int  beam_seek_delta[WHISPER_MAX_DECODERS];
+                    bool beam_has_ts    [WHISPER_MAX_DECODERS];
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (seq_src[j] == j) {
+                            continue;
+                        }
+
+                        const auto & src = state->decoders[seq_src[j]];
+
+                        beam_seek_delta[j] = src.seek_delta;
+                        beam_has_ts    [j] = src.has_ts;
+
+                        beam_sequences[j] = src.sequence;
+
+                        beam_grammars[j].stacks       = src.grammar.stacks;
+                        beam_grammars[j].partial_utf8 = src.grammar.partial_utf8;
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
-                        if (decoder.completed || decoder.failed) {
+                        if ((decoder.completed && !beam_refill[j]) || decoder.failed) {
                             continue;
                         }
 
-                        whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
-                        whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
-                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
+                        // a finished beam continues with the next best candidate
+                        if (beam_refill[j]) {
+                            decoder.completed = false;
+                            beam_refill[j]    = false;
+                        }
+
+                        const auto & cur = beam_selected[j];
+
+                        if (seq_src[j] != j) {
+                            decoder.seek_delta = beam_seek_delta[j];
+                            decoder.has_ts     = beam_has_ts[j];
+
+                            std::swap(decoder.sequence,       beam_sequences[j]);
+                            std::swap(decoder.grammar.stacks, beam_grammars[j].stacks);
+
+                            decoder.grammar.partial_utf8 = beam_grammars[j].partial_utf8;
+                        }
+
+                        decoder.sequence.tokens.push_back(cur.token);
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+                        decoder.sequence.hash             = cur.hash;
+
+                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    }
+
+                    if (seq_fork) {
+                        whisper_kv_cache_seq_remap(state->kv_self, seq_src, n_decoders_cur);
                     }
                 }
 
@@ -7277,19 +10604,10 @@ int whisper_full_with_state(
                            (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
                            (has_ts && seek + seek_delta + delta_min >= seek_end)       // end of audio reached (100ms)
                            ) {
-                            if (result_len == 0 && !params.no_timestamps) {
-                                if (seek + seek_delta + delta_min >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
-                                    failed = true;
-                                    continue;
-                                }
-                            }
-
-                            if (params.single_segment || params.no_timestamps) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            if (!finish_segment(decoder.sequence, seek_delta, i)) {
+                                WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
+                                failed = true;
+                                continue;
                             }
 
                             WHISPER_LOG_DEBUG("%s: decoder %d completed\n", __func__, j);
@@ -7305,6 +10623,14 @@ int whisper_full_with_state(
                         }
                     }
 
+                    // [EXPERIMENTAL] early repetition-loop detection - no need to decode until n_max once the loop is evident
+                    if (params.rep_n_tokens > 0 && whisper_sequence_is_loop(*ctx, decoder.sequence, params.rep_ngram_max, params.rep_n_tokens)) {
+                        WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop (i = %d)\n", __func__, j, i);
+                        failed = true;
+                        state->n_fail_r++;
+                        continue;
+                    }
+
                     // sometimes, the decoding can get stuck in a repetition loop
                     // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
                     if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
@@ -7314,6 +10640,34 @@ int whisper_full_with_state(
                     }
                 }
 
+                // [beam search] patience - collect the beams that ended the segment without the end of text token (e.g. at
+                // the end of the audio) and stop once round(patience*beam_size) sequences have finished
+                if (beam_patience) {
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        const auto & decoder = state->decoders[j];
+
+                        if (!decoder.completed || decoder.failed || beam_refill[j]) {
+                            continue;
+                        }
+
+                        beam_finished_all.push_back({ decoder.sequence, decoder.seek_delta, decoder.has_ts });
+                        beam_refill[j] = true;
+                    }
+
+                    if ((int) beam_finished_all.size() >= n_finish) {
+                        for (int j = 0; j < n_decoders_cur; ++j) {
+                            auto & decoder = state->decoders[j];
+
+                            if (decoder.completed || decoder.failed) {
+                                continue;
+                            }
+
+                            WHISPER_LOG_DEBUG("%s: decoder %d: stopped due to patience (%d finished)\n", __func__, j, (int) beam_finished_all.size());
+                            decoder.failed = true;
+                        }
+                    }
+                }
+
                 // check if all decoders have finished (i.e. completed or failed)
                 {
                     bool completed_all = true;
@@ -7343,7 +10697,33 @@ int whisper_full_with_state(
 
                     const int n_past = prompt.size() + i;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
+                    // [EXPERIMENTAL] speculative decoding - the logits after an accepted draft token are already computed
+                    const bool accepted =
+                        speculative &&
+                        draft_next < (int) draft_tokens.size() &&
+                        draft_tokens[draft_next] == state->decoders[0].sequence.tokens.back().id;
+
+                    if (accepted) {
+                        state->decoders[0].i_batch = ++draft_next;
+                        state->n_draft_accept++;
+                    } else if (speculative) {
+                        // remove the rejected draft tokens from the KV cache and propose new ones
+                        if (!draft_tokens.empty()) {
+                            whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+                        }
+
+                        const int n_draft = std::min(params.draft_n_tokens, whisper_n_text_ctx(ctx) - 1 - n_past);
+
+                        draft_tokens.clear();
+                        draft_next = 0;
+
+                        if (n_draft > 0 && !whisper_draft_propose(*state, prompt, state->decoders[0], params, n_draft, draft_tokens)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+                            return -9;
+                        }
+                    }
+
+                    for (int j = 0; j < n_decoders_cur && !accepted; ++j) {
                         auto & decoder = state->decoders[j];
 
                         if (decoder.failed || decoder.completed) {
@@ -7362,16 +10742,40 @@ int whisper_full_with_state(
                         batch.n_tokens++;
                     }
 
-                    assert(batch.n_tokens > 0);
+                    // the draft tokens follow the last sampled token - the logits after each of them are verified in
+                    // the next steps
+                    for (int k = 0; k < (int) draft_tokens.size() && !accepted; ++k) {
+                        batch.token   [batch.n_tokens]    = draft_tokens[k];
+                        batch.pos     [batch.n_tokens]    = n_past + 1 + k;
+                        batch.n_seq_id[batch.n_tokens]    = 1;
+                        batch.seq_id  [batch.n_tokens][0] = 0;
+                        batch.logits  [batch.n_tokens]    = 1;
+                        batch.n_tokens++;
+                    }
+
+                    // [EXPERIMENTAL] greedy_on_device - only the argmax is needed at t == 0
+                    const bool reduce = reduce_logits && t_cur < 1e-6f && batch.n_tokens == 1 && !accepted;
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                        return -9;
+                    if (!accepted) {
+                        assert(batch.n_tokens > 0);
+
+                        state->logits_reduce  .enabled = reduce;
+                        state->logits_restrict.enabled = restrict_logits;
+
+                        const bool ok = whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data);
+
+                        state->logits_reduce  .enabled = false;
+                        state->logits_restrict.enabled = false;
+
+                        if (!ok) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
                         std::atomic<int> j_cur(0);
 
@@ -7389,30 +10793,53 @@ int whisper_full_with_state(
                                     continue;
                                 }
 
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                                if (reduce) {
+                                    whisper_process_logits_reduced(*ctx, *state, decoder);
+                                } else {
+                                    whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                                }
                             }
                         };
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
+                        state->pool.run(std::min(params.n_threads, n_decoders_cur), [&](int) { process(); });
+                    }
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                }
+            }
 
-                            process();
+            // [beam search] patience - rank the finished sequences, together with the beams that did not finish
+            if (beam_patience) {
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    const auto & decoder = state->decoders[j];
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                    if (!decoder.completed && !decoder.failed) {
+                        beam_finished_all.push_back({ decoder.sequence, decoder.seek_delta, decoder.has_ts });
                     }
+                }
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                for (auto & f : beam_finished_all) {
+                    f.sequence.tokens.resize(f.sequence.result_len);
+                    whisper_sequence_score(params, f.sequence);
+                }
+
+                std::stable_sort(beam_finished_all.begin(), beam_finished_all.end(), [](const beam_finished & a, const beam_finished & b) {
+                    return a.sequence.score > b.sequence.score;
+                });
+
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (j < (int) beam_finished_all.size()) {
+                        std::swap(decoder.sequence, beam_finished_all[j].sequence);
+
+                        decoder.seek_delta = beam_finished_all[j].seek_delta;
+                        decoder.has_ts     = beam_finished_all[j].has_ts;
+                        decoder.completed  = true;
+                        decoder.failed     = false;
+                    } else {
+                        decoder.failed = true;
+                    }
                 }
             }
 
@@ -7636,6 +11063,11 @@ int whisper_full_with_state(
                 seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
             }
 
+            // [EXPERIMENTAL] batched encoder - move to the next window, whatever the timestamps
+            if (encode_batch) {
+                seek_delta = std::min(seek_end - seek, seek_stride);
+            }
+
             // update audio window
             seek += seek_delta;
 
@@ -7646,6 +11078,35 @@ int whisper_full_with_state(
     return 0;
 }
 
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_internal(ctx, state, params, samples, n_samples, nullptr);
+}
+
+int whisper_full_from_source_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+    struct whisper_audio_source  source) {
+    if (source.read == nullptr) {
+        WHISPER_LOG_ERROR("%s: the audio source has no read callback\n", __func__);
+        return -1;
+    }
+
+    return whisper_full_internal(ctx, state, params, nullptr, 0, &source);
+}
+
+int whisper_full_from_source(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+    struct whisper_audio_source  source) {
+    return whisper_full_from_source_with_state(ctx, ctx->state, params, source);
+}
+
 int whisper_full(
         struct whisper_context * ctx,
     struct whisper_full_params   params,
@@ -7749,6 +11210,10 @@ int whisper_full_parallel(
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
+        ctx->state->t_draft_us     += states[i]->t_draft_us;
+        ctx->state->n_draft        += states[i]->n_draft;
+        ctx->state->n_draft_accept += states[i]->n_draft_accept;
+
         whisper_free_state(states[i]);
     }
 
@@ -7769,6 +11234,402 @@ int whisper_full_parallel(
     return ret;
 }
 
+//
+// [EXPERIMENTAL] streaming transcription
+//
+
+struct whisper_stream_params whisper_stream_default_params(void) {
+    whisper_stream_params result = {
+        /* step_ms          = */ 1000,
+        /* buffer_ms        = */ 15000,
+        /* n_agree          = */ 2,
+        /* reduce_audio_ctx = */ true,
+    };
+    return result;
+}
+
+// a text token of the transcription of the retained audio - the timestamps are relative to the start of the stream
+struct whisper_stream_token {
+    whisper_token id;
+
+    int64_t t0;
+    int64_t t1;
+
+    int64_t seg_t1; // end of the segment if this is its last text token, -1 otherwise
+};
+
+struct whisper_stream_segment {
+    int64_t t0;
+    int64_t t1;
+
+    std::string text;
+};
+
+struct whisper_stream {
+    whisper_context * ctx   = nullptr;
+    whisper_state   * state = nullptr;
+
+    whisper_mel_stream * mel = nullptr;
+
+    whisper_full_params   wparams;
+    whisper_stream_params sparams;
+
+    int64_t n_total   = 0; // number of samples pushed so far
+    int64_t n_decoded = 0; // n_total at the last transcription
+    int64_t s_begin   = 0; // the first retained sample
+
+    // the initial prompt followed by the committed tokens that precede the retained audio
+    std::vector<whisper_token> prompt;
+
+    // the committed tokens of the retained audio - each transcription starts with them
+    std::vector<whisper_stream_token> committed_buf;
+
+    // the last n_agree transcriptions without the committed tokens
+    std::vector<std::vector<whisper_stream_token>> hyps;
+
+    std::vector<whisper_stream_segment> committed;
+
+    std::string partial;
+};
+
+// commit the first n_commit tokens of the last transcription as a new segment
+static int whisper_stream_commit(whisper_stream & ws, int n_commit) {
+    if (n_commit <= 0) {
+        return 0;
+    }
+
+    const auto & hyp = ws.hyps.back();
+
+    whisper_stream_segment seg = { hyp[0].t0, hyp[n_commit - 1].t1, {} };
+
+    if (!ws.committed.empty()) {
+        seg.t0 = std::max(seg.t0, ws.committed.back().t1);
+    }
+    seg.t1 = std::max(seg.t0, seg.t1);
+
+    for (int i = 0; i < n_commit; ++i) {
+        seg.text += whisper_token_to_str(ws.ctx, hyp[i].id);
+    }
+
+    ws.committed.push_back(std::move(seg));
+    ws.committed_buf.insert(ws.committed_buf.end(), hyp.begin(), hyp.begin() + n_commit);
+
+    // the agreeing transcriptions share the committed prefix
+    for (auto & h : ws.hyps) {
+        h.erase(h.begin(), h.begin() + std::min<size_t>(h.size(), n_commit));
+    }
+
+    return 1;
+}
+
+// drop the retained audio up to t_cut, together with the committed tokens [0, n_cut) that it contains
+static void whisper_stream_cut(whisper_stream & ws, int64_t t_cut, int n_cut) {
+    const int64_t s_cut = std::min(ws.n_total, t_cut*WHISPER_SAMPLE_RATE/100);
+
+    ws.s_begin += whisper_mel_stream_drop(ws.mel, s_cut - ws.s_begin);
+
+    for (int i = 0; i < n_cut; ++i) {
+        ws.prompt.push_back(ws.committed_buf[i].id);
+    }
+    ws.committed_buf.erase(ws.committed_buf.begin(), ws.committed_buf.begin() + n_cut);
+
+    // only the end of the prompt is used by the decoder
+    const int n_prompt_max = whisper_n_text_ctx(ws.ctx)/2;
+    if ((int) ws.prompt.size() > n_prompt_max) {
+        ws.prompt.erase(ws.prompt.begin(), ws.prompt.end() - n_prompt_max);
+    }
+}
+
+static void whisper_stream_update_partial(whisper_stream & ws) {
+    ws.partial.clear();
+
+    if (ws.hyps.empty()) {
+        return;
+    }
+
+    for (const auto & token : ws.hyps.back()) {
+        ws.partial += whisper_token_to_str(ws.ctx, token.id);
+    }
+}
+
+// transcribe the retained audio and commit the tokens on which the last n_agree transcriptions agree
+// returns the number of newly committed segments or a negative value on error
+static int whisper_stream_transcribe(whisper_stream & ws) {
+    whisper_context * ctx = ws.ctx;
+
+    ws.n_decoded = ws.n_total;
+
+    const int n = whisper_mel_stream_n_samples(ws.mel);
+
+    // whisper_full() needs at least 100 ms of audio
+    if (n < WHISPER_SAMPLE_RATE/10) {
+        return 0;
+    }
+
+    if (whisper_mel_stream_set_with_state(ctx, ws.state, ws.mel) != 0) {
+        return -1;
+    }
+
+    // the signal energy refines the token timestamps, which locate the committed tokens in the audio
+    ws.state->energy = get_signal_energy(ws.mel->samples.data() + ws.mel->s_skip, n, 32);
+    ws.state->energy_offset = 0;
+
+    whisper_full_params params = ws.wparams;
+
+    params.prompt_tokens   = ws.prompt.empty() ? nullptr : ws.prompt.data();
+    params.prompt_n_tokens = ws.prompt.size();
+
+    if (ws.sparams.reduce_audio_ctx) {
+        // one encoder position per 2 mel frames, with some room after the end of the audio
+        const int n_ctx_max = params.audio_ctx > 0 ? params.audio_ctx : whisper_n_audio_ctx(ctx);
+
+        params.audio_ctx = std::min(n_ctx_max, (int) GGML_PAD(n/(2*WHISPER_HOP_LENGTH) + 32, 64));
+    }
+
+    const int ret = whisper_full_internal(ctx, ws.state, params, nullptr, 0, nullptr);
+    if (ret != 0) {
+        WHISPER_LOG_ERROR("%s: failed to transcribe the retained audio (%d)\n", __func__, ret);
+        return -1;
+    }
+
+    const int64_t t_offset = ws.s_begin*100/WHISPER_SAMPLE_RATE;
+
+    std::vector<whisper_stream_token> hyp;
+
+    for (const auto & seg : ws.state->result_all) {
+        const size_t n_before = hyp.size();
+
+        for (const auto & token : seg.tokens) {
+            if (token.id < whisper_token_eot(ctx)) {
+                hyp.push_back({ token.id, t_offset + token.t0, t_offset + token.t1, -1 });
+            }
+        }
+
+        if (hyp.size() > n_before) {
+            hyp.back().seg_t1 = t_offset + seg.t1;
+        }
+    }
+
+    // skip the committed tokens of the retained audio
+    {
+        const auto & cb = ws.committed_buf;
+
+        size_t n_skip = 0;
+
+        while (n_skip < cb.size() && n_skip < hyp.size() && hyp[n_skip].id == cb[n_skip].id) {
+            ++n_skip;
+        }
+
+        if (n_skip < cb.size()) {
+            // the committed audio was transcribed differently - skip by time and then the overlap with the committed text
+            n_skip = 0;
+            while (n_skip < hyp.size() && hyp[n_skip].t0 < cb.back().t1 - 10) {
+                ++n_skip;
+            }
+
+            for (int k = std::min<int>(8, std::min(cb.size(), hyp.size() - n_skip)); k > 0; --k) {
+                bool match = true;
+                for (int i = 0; i < k && match; ++i) {
+                    match = hyp[n_skip + i].id == cb[cb.size() - k + i].id;
+                }
+
+                if (match) {
+                    n_skip += k;
+                    break;
+                }
+            }
+        }
+
+        hyp.erase(hyp.begin(), hyp.begin() + n_skip);
+    }
+
+    ws.hyps.push_back(std::move(hyp));
+    if ((int) ws.hyps.size() > ws.sparams.n_agree) {
+        ws.hyps.erase(ws.hyps.begin());
+    }
+
+    int n_new = 0;
+
+    // LocalAgreement: commit the longest common prefix of the last n_agree transcriptions
+    if ((int) ws.hyps.size() == ws.sparams.n_agree) {
+        const auto & last = ws.hyps.back();
+
+        size_t n_commit = last.size();
+
+        for (const auto & h : ws.hyps) {
+            size_t k = 0;
+            while (k < n_commit && k < h.size() && h[k].id == last[k].id) {
+                ++k;
+            }
+            n_commit = k;
+        }
+
+        n_new += whisper_stream_commit(ws, n_commit);
+    }
+
+    // trim the retained audio at the end of the last committed segment
+    if ((int64_t) n*1000 > (int64_t) ws.sparams.buffer_ms*WHISPER_SAMPLE_RATE) {
+        int n_cut = 0;
+        for (int i = (int) ws.committed_buf.size() - 1; i >= 0; --i) {
+            if (ws.committed_buf[i].seg_t1 >= 0) {
+                n_cut = i + 1;
+                break;
+            }
+        }
+
+        if (n_cut > 0) {
+            whisper_stream_cut(ws, ws.committed_buf[n_cut - 1].seg_t1, n_cut);
+        } else if ((int64_t) n*1000 > (int64_t) (1000*WHISPER_CHUNK_SIZE - ws.sparams.step_ms)*WHISPER_SAMPLE_RATE) {
+            // nothing can be trimmed and the next step would not fit in the window - commit everything and start over
+            n_new += whisper_stream_commit(ws, ws.hyps.back().size());
+            ws.hyps.clear();
+
+            const int64_t t_cut = ws.committed_buf.empty() ? ws.n_total*100/WHISPER_SAMPLE_RATE : ws.committed_buf.back().t1;
+
+            whisper_stream_cut(ws, t_cut, ws.committed_buf.size());
+        }
+    }
+
+    whisper_stream_update_partial(ws);
+
+    return n_new;
+}
+
+struct whisper_stream * whisper_stream_init(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+  struct whisper_stream_params   stream_params) {
+    if (stream_params.step_ms <= 0 || stream_params.step_ms > 1000*WHISPER_CHUNK_SIZE/2) {
+        WHISPER_LOG_ERROR("%s: step_ms must be in (0, %d]\n", __func__, 1000*WHISPER_CHUNK_SIZE/2);
+        return nullptr;
+    }
+
+    if (params.vad) {
+        WHISPER_LOG_WARN("%s: VAD is not supported - disabling\n", __func__);
+        params.vad = false;
+    }
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        return nullptr;
+    }
+
+    whisper_stream * ws = new whisper_stream;
+
+    ws->ctx   = ctx;
+    ws->state = state;
+    ws->mel   = whisper_mel_stream_init(ctx, params.n_threads);
+
+    // the prompt is owned by the stream
+    if (params.prompt_tokens && params.prompt_n_tokens > 0) {
+        ws->prompt.assign(params.prompt_tokens, params.prompt_tokens + params.prompt_n_tokens);
+    } else if (params.initial_prompt) {
+        ws->prompt.resize(1024);
+        int n_needed = whisper_tokenize(ctx, params.initial_prompt, ws->prompt.data(), ws->prompt.size());
+        if (n_needed < 0) {
+            ws->prompt.resize(-n_needed);
+            n_needed = whisper_tokenize(ctx, params.initial_prompt, ws->prompt.data(), ws->prompt.size());
+        }
+        ws->prompt.resize(std::max(0, n_needed));
+    }
+
+    params.initial_prompt  = nullptr;
+    params.prompt_tokens   = nullptr;
+    params.prompt_n_tokens = 0;
+
+    // each transcription covers the retained audio only and the results are reported by the stream
+    params.no_context       = true;
+    params.single_segment   = false;
+    params.token_timestamps = true;
+    params.offset_ms        = 0;
+    params.duration_ms      = 0;
+    params.print_progress   = false;
+    params.print_realtime   = false;
+
+    params.new_segment_callback           = nullptr;
+    params.new_segment_callback_user_data = nullptr;
+    params.progress_callback              = nullptr;
+    params.progress_callback_user_data    = nullptr;
+
+    stream_params.n_agree   = std::max(1, stream_params.n_agree);
+    stream_params.buffer_ms = std::min(std::max(stream_params.buffer_ms, stream_params.step_ms), 1000*WHISPER_CHUNK_SIZE - stream_params.step_ms);
+
+    ws->wparams = params;
+    ws->sparams = stream_params;
+
+    return ws;
+}
+
+void whisper_stream_free(struct whisper_stream * stream) {
+    if (stream) {
+        whisper_mel_stream_free(stream->mel);
+        whisper_free_state(stream->state);
+
+        delete stream;
+    }
+}
+
+int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples) {
+    auto & ws = *stream;
+
+    if (whisper_mel_stream_push(ws.mel, samples, n_samples) != 0) {
+        return -1;
+    }
+
+    ws.n_total += n_samples;
+
+    if ((ws.n_total - ws.n_decoded)*1000 < (int64_t) ws.sparams.step_ms*WHISPER_SAMPLE_RATE) {
+        return 0;
+    }
+
+    return whisper_stream_transcribe(ws);
+}
+
+int whisper_stream_flush(struct whisper_stream * stream) {
+    auto & ws = *stream;
+
+    int n_new = 0;
+
+    if (ws.n_total > ws.n_decoded) {
+        const int ret = whisper_stream_transcribe(ws);
+        if (ret < 0) {
+            return ret;
+        }
+
+        n_new += ret;
+    }
+
+    if (!ws.hyps.empty()) {
+        n_new += whisper_stream_commit(ws, ws.hyps.back().size());
+        ws.hyps.clear();
+    }
+
+    whisper_stream_cut(ws, ws.n_total*100/WHISPER_SAMPLE_RATE, ws.committed_buf.size());
+    whisper_stream_update_partial(ws);
+
+    return n_new;
+}
+
+int whisper_stream_n_committed(struct whisper_stream * stream) {
+    return stream->committed.size();
+}
+
+const char * whisper_stream_get_committed_text(struct whisper_stream * stream, int i_segment) {
+    return stream->committed[i_segment].text.c_str();
+}
+
+int64_t whisper_stream_get_committed_t0(struct whisper_stream * stream, int i_segment) {
+    return stream->committed[i_segment].t0;
+}
+
+int64_t whisper_stream_get_committed_t1(struct whisper_stream * stream, int i_segment) {
+    return stream->committed[i_segment].t1;
+}
+
+const char * whisper_stream_get_partial_text(struct whisper_stream * stream) {
+    return stream->partial.c_str();
+}
+
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
     return state->result_all.size();
 }
@@ -8337,9 +12198,9 @@ static void whisper_exp_compute_token_level_timestamps(
     auto & segment = state.result_all[i_segment];
     auto & tokens  = segment.tokens;
 
-    const int n_samples = state.energy.size();
+    const int n_samples = state.energy_offset + state.energy.size();
 
-    if (n_samples == 0) {
+    if (state.energy.empty()) {
         WHISPER_LOG_ERROR("%s: no signal data available\n", __func__);
         return;
     }
@@ -8469,15 +12330,22 @@ static void whisper_exp_compute_token_level_timestamps(
     {
         const int hw = WHISPER_SAMPLE_RATE/8;
 
+        // with an audio source, the signal energy before energy_offset has been dropped - see whisper_mel_source_fill()
+        const int s_min = state.energy_offset;
+
+        const auto energy = [&](int k) {
+            return state.energy[k - s_min];
+        };
+
         for (int j = 0; j < n; j++) {
             if (tokens[j].id >= whisper_token_eot(&ctx)) {
                 continue;
             }
 
-            int s0 = timestamp_to_sample(tokens[j].t0, n_samples);
-            int s1 = timestamp_to_sample(tokens[j].t1, n_samples);
+            int s0 = std::max(s_min, timestamp_to_sample(tokens[j].t0, n_samples));
+            int s1 = std::max(s_min, timestamp_to_sample(tokens[j].t1, n_samples));
 
-            const int ss0 = std::max(s0 - hw, 0);
+            const int ss0 = std::max(s0 - hw, s_min);
             const int ss1 = std::min(s1 + hw, n_samples);
 
             const int ns = ss1 - ss0;
@@ -8485,15 +12353,15 @@ static void whisper_exp_compute_token_level_timestamps(
             float sum = 0.0f;
 
             for (int k = ss0; k < ss1; k++) {
-                sum += state.energy[k];
+                sum += energy(k);
             }
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (state.energy[k] > thold && j > 0) {
-                    while (k > 0 && state.energy[k] > thold) {
+                if (energy(k) > thold && j > 0) {
+                    while (k > s_min && energy(k) > thold) {
                         k--;
                     }
                     tokens[j].t0 = sample_to_timestamp(k);
@@ -8503,7 +12371,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s0 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k < s1) {
+                    while (energy(k) < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
@@ -8513,8 +12381,8 @@ static void whisper_exp_compute_token_level_timestamps(
 
             {
                 int k = s1;
-                if (state.energy[k] > thold) {
-                    while (k < n_samples - 1 && state.energy[k] > thold) {
+                if (energy(k) > thold) {
+                    while (k < n_samples - 1 && energy(k) > thold) {
                         k++;
                     }
                     tokens[j].t1 = sample_to_timestamp(k);
@@ -8524,7 +12392,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s1 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k > s0) {
+                    while (energy(k) < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
@@ -0,0 +1,112 @@
+#include "whisper.h"
+#include "common-whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+
+// the logits of the first token after the SOT prompt - they depend on the whole log mel spectrogram of the window
+// through the encoder, so two spectrograms give the same logits only if they are the same
+static std::vector<float> get_logits(struct whisper_context * wctx, struct whisper_state * state) {
+    assert(whisper_encode_with_state(wctx, state, 0, 4) == 0);
+
+    const whisper_token prompt[] = {
+        whisper_token_sot(wctx),
+        whisper_token_not(wctx),
+    };
+
+    assert(whisper_decode_with_state(wctx, state, prompt, 2, 0, 4) == 0);
+
+    const int n_vocab = whisper_n_vocab(wctx);
+    const float * logits = whisper_get_logits_from_state(state) + n_vocab;
+
+    return std::vector<float>(logits, logits + n_vocab);
+}
+
+static void assert_logits_equal(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max_diff = std::max(max_diff, std::fabs(a[i] - b[i]));
+    }
+
+    printf("max logits diff = %g\n", max_diff);
+    assert(max_diff < 1e-3f);
+}
+
+// push the samples in chunks through a whisper_mel_stream and compare with whisper_pcm_to_mel()
+// n_drop samples are dropped from the start of the stream once they have been pushed
+static void test_mel_stream(
+        struct whisper_context * wctx,
+        const std::vector<float> & pcmf32,
+        int n_chunk,
+        int n_drop) {
+    printf("%s: n_chunk = %d, n_drop = %d\n", __func__, n_chunk, n_drop);
+
+    struct whisper_mel_stream * stream = whisper_mel_stream_init(wctx, 4);
+    assert(stream != nullptr);
+
+    int n_dropped = 0;
+
+    for (size_t i = 0; i < pcmf32.size(); i += n_chunk) {
+        const int n = std::min<size_t>(n_chunk, pcmf32.size() - i);
+
+        assert(whisper_mel_stream_push(stream, pcmf32.data() + i, n) == 0);
+
+        if (n_dropped == 0 && n_drop > 0 && (int) (i + n) >= n_drop) {
+            n_dropped = whisper_mel_stream_drop(stream, n_drop);
+            assert(n_dropped > 0 && n_dropped <= n_drop && n_dropped % WHISPER_HOP_LENGTH == 0);
+        }
+    }
+
+    assert(whisper_mel_stream_n_samples(stream) == (int) pcmf32.size() - n_dropped);
+
+    struct whisper_state * state_ref    = whisper_init_state(wctx);
+    struct whisper_state * state_stream = whisper_init_state(wctx);
+
+    assert(whisper_pcm_to_mel_with_state(wctx, state_ref, pcmf32.data() + n_dropped, pcmf32.size() - n_dropped, 4) == 0);
+    assert(whisper_mel_stream_set_with_state(wctx, state_stream, stream) == 0);
+
+    assert(whisper_n_len_from_state(state_ref) == whisper_n_len_from_state(state_stream));
+
+    assert_logits_equal(get_logits(wctx, state_ref), get_logits(wctx, state_stream));
+
+    whisper_free_state(state_stream);
+    whisper_free_state(state_ref);
+
+    whisper_mel_stream_free(stream);
+}
+
+int main() {
+    std::string whisper_model_path = "../../models/ggml-base.en.bin";
+    std::string sample_path        = "../../samples/jfk.wav";
+
+    // Load the sample audio file
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+    assert(read_audio_data(sample_path.c_str(), pcmf32, pcmf32s, false));
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    struct whisper_context * wctx = whisper_init_from_file_with_params_no_state(
+            whisper_model_path.c_str(),
+            cparams);
+    assert(wctx != nullptr);
+
+    // chunks that are not a multiple of the hop length, as from an audio capture callback
+    test_mel_stream(wctx, pcmf32, 1000, 0);
+    test_mel_stream(wctx, pcmf32, 16000, 0);
+    test_mel_stream(wctx, pcmf32, 1000, 3*WHISPER_SAMPLE_RATE + 77);
+
+    whisper_free(wctx);
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "whisper.h"
+#include "common-whisper.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+
+// lowercase words separated by a single space - the committed text can differ from the full transcription in
+// punctuation and capitalization, since its tokens are committed before the end of the sentence is heard
+static std::string normalize(const std::string & text) {
+    std::string result;
+
+    for (const char c : text) {
+        if (std::isalnum((unsigned char) c)) {
+            result += std::tolower((unsigned char) c);
+        } else if (std::isspace((unsigned char) c) && !result.empty() && result.back() != ' ') {
+            result += ' ';
+        }
+    }
+
+    while (!result.empty() && result.back() == ' ') {
+        result.pop_back();
+    }
+
+    return result;
+}
+
+// push the samples in chunks through a whisper_stream and compare the committed text with whisper_full()
+static void test_stream(
+        struct whisper_context * wctx,
+        struct whisper_full_params wparams,
+        const std::vector<float> & pcmf32,
+        const std::string & text_full,
+        int n_chunk,
+        int step_ms) {
+    printf("%s: n_chunk = %d, step_ms = %d\n", __func__, n_chunk, step_ms);
+
+    struct whisper_stream_params sparams = whisper_stream_default_params();
+    sparams.step_ms = step_ms;
+
+    struct whisper_stream * stream = whisper_stream_init(wctx, wparams, sparams);
+    assert(stream != nullptr);
+
+    for (size_t i = 0; i < pcmf32.size(); i += n_chunk) {
+        const int n = std::min<size_t>(n_chunk, pcmf32.size() - i);
+
+        assert(whisper_stream_push(stream, pcmf32.data() + i, n) >= 0);
+    }
+
+    assert(whisper_stream_flush(stream) >= 0);
+
+    // the partial text is committed by the flush
+    assert(std::string(whisper_stream_get_partial_text(stream)).empty());
+
+    const int n_committed = whisper_stream_n_committed(stream);
+    assert(n_committed > 0);
+
+    std::string text;
+
+    int64_t t_prev = 0;
+    for (int i = 0; i < n_committed; ++i) {
+        const int64_t t0 = whisper_stream_get_committed_t0(stream, i);
+        const int64_t t1 = whisper_stream_get_committed_t1(stream, i);
+
+        assert(t_prev <= t0 && t0 <= t1);
+        assert(t1 <= (int64_t) (100*pcmf32.size()/WHISPER_SAMPLE_RATE) + 1);
+
+        t_prev = t0;
+
+        text += whisper_stream_get_committed_text(stream, i);
+    }
+
+    printf("full:      '%s'\n", text_full.c_str());
+    printf("committed: '%s'\n", text.c_str());
+
+    assert(normalize(text) == normalize(text_full));
+
+    whisper_stream_free(stream);
+}
+
+int main() {
+    std::string whisper_model_path = "../../models/ggml-base.en.bin";
+    std::string sample_path        = "../../samples/jfk.wav";
+
+    // Load the sample audio file
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+    assert(read_audio_data(sample_path.c_str(), pcmf32, pcmf32s, false));
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    struct whisper_context * wctx = whisper_init_from_file_with_params(
+            whisper_model_path.c_str(),
+            cparams);
+    assert(wctx != nullptr);
+
+    struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_progress = false;
+    wparams.language       = "en";
+    wparams.n_threads      = 4;
+
+    assert(whisper_full(wctx, wparams, pcmf32.data(), pcmf32.size()) == 0);
+
+    std::string text_full;
+    for (int i = 0; i < whisper_full_n_segments(wctx); ++i) {
+        text_full += whisper_full_get_segment_text(wctx, i);
+    }
+
+    assert(!text_full.empty());
+
+    // 100 ms chunks, as from an audio capture callback
+    test_stream(wctx, wparams, pcmf32, text_full, WHISPER_SAMPLE_RATE/10, 1000);
+    test_stream(wctx, wparams, pcmf32, text_full, WHISPER_SAMPLE_RATE,    2000);
+
+    whisper_free(wctx);
+
+    return 0;
+}